@@ -0,0 +1,574 @@
+#include "Precomp.h"
+#include "CPPSourceFile.h"
+#include "DbMgr.h"
+#include "Node.h"
+#include "IndexSession.h"
+#include "CompileCache.h"
+#include "BoundedQueue.h"
+#include "IndexHistory.h"
+#include "BatchIndexer.h"
+#define FMT_HEADER_ONLY
+#include "fmt/format.h"
+#include <thread>
+#include <filesystem>
+#include <deque>
+#include <numeric>
+#include <condition_variable>
+
+namespace
+{
+    std::string Trim(const std::string& str)
+    {
+        size_t first = str.find_first_not_of(" \t\r");
+        if (first == std::string::npos)
+            return std::string();
+        size_t last = str.find_last_not_of(" \t\r");
+        return str.substr(first, last - first + 1);
+    }
+
+    // Reads the run of #include directives at the top of a source file and
+    // stops at the first line that is anything else. Quoted includes found
+    // next to the source are made absolute so they compare equal across
+    // directories and can be spelled from the generated PCH header.
+    std::vector<std::string> LeadingIncludes(const std::string& file)
+    {
+        std::vector<std::string> includes;
+        std::ifstream ifstream(file);
+        std::filesystem::path dir = std::filesystem::path(file).parent_path();
+        std::string line;
+        bool inComment = false;
+        while (std::getline(ifstream, line))
+        {
+            std::string text;
+            size_t pos = 0;
+            while (pos < line.size())
+            {
+                if (inComment)
+                {
+                    size_t end = line.find("*/", pos);
+                    if (end == std::string::npos)
+                        break;
+                    inComment = false;
+                    pos = end + 2;
+                }
+                else if (line.compare(pos, 2, "/*") == 0)
+                {
+                    inComment = true;
+                    pos += 2;
+                }
+                else if (line.compare(pos, 2, "//") == 0)
+                    break;
+                else
+                    text.push_back(line[pos++]);
+            }
+            text = Trim(text);
+            if (text.empty())
+                continue;
+            if (text[0] != '#')
+                break;
+            std::string directive = Trim(text.substr(1));
+            if (directive.starts_with("pragma") && directive.find("once") != std::string::npos)
+                continue;
+            if (!directive.starts_with("include"))
+                break;
+            std::string target = Trim(directive.substr(sizeof("include") - 1));
+            if (target.size() > 2 && target[0] == '"')
+            {
+                size_t end = target.find('"', 1);
+                if (end == std::string::npos)
+                    break;
+                std::string name = target.substr(1, end - 1);
+                std::filesystem::path local = dir / name;
+                if (std::filesystem::exists(local))
+                    name = local.lexically_normal().generic_string();
+                includes.push_back("\"" + name + "\"");
+            }
+            else if (target.size() > 2 && target[0] == '<')
+            {
+                size_t end = target.find('>');
+                if (end == std::string::npos)
+                    break;
+                includes.push_back(target.substr(0, end + 1));
+            }
+            else
+                break;
+        }
+        return includes;
+    }
+}
+
+BatchIndexer::BatchIndexer(const Options& options) :
+    m_options(options)
+{
+    if (m_options.jobs == 0)
+        m_options.jobs = 1;
+}
+
+std::string BatchIndexer::OutputPathFor(const std::string& outDir, const CompileCommand& cmd)
+{
+    // The same source can appear several times with different flags, so the
+    // name carries a hash of the file and its object output.
+    size_t hash = std::hash<std::string>{}(cmd.file + "|" + cmd.output);
+    std::string name = fmt::format("{}.{:016x}.osy",
+        std::filesystem::path(cmd.file).stem().string(), (uint64_t)hash);
+    return (std::filesystem::path(outDir) / name).string();
+}
+
+std::vector<CompileCommand> BatchIndexer::SelectShard(const std::vector<CompileCommand>& commands,
+    size_t index, size_t count)
+{
+    std::vector<std::pair<uintmax_t, size_t>> costs;
+    for (size_t idx = 0; idx < commands.size(); ++idx)
+    {
+        std::error_code ec;
+        uintmax_t size = std::filesystem::file_size(commands[idx].file, ec);
+        costs.push_back(std::make_pair(ec ? 0 : size, idx));
+    }
+    // Ties are broken by file name and output, never by position, so the
+    // order of entries in the database does not matter.
+    std::sort(costs.begin(), costs.end(), [&](const auto& a, const auto& b)
+    {
+        if (a.first != b.first)
+            return a.first > b.first;
+        const CompileCommand& ca = commands[a.second];
+        const CompileCommand& cb = commands[b.second];
+        return std::tie(ca.file, ca.output) < std::tie(cb.file, cb.output);
+    });
+
+    std::vector<uintmax_t> loads(count);
+    std::vector<CompileCommand> shard;
+    for (const auto& cost : costs)
+    {
+        size_t target = std::min_element(loads.begin(), loads.end()) - loads.begin();
+        loads[target] += std::max<uintmax_t>(cost.first, 1);
+        if (target == index)
+            shard.push_back(commands[cost.second]);
+    }
+    return shard;
+}
+
+void BatchIndexer::ParallelFor(size_t count, size_t jobs, const std::function<void(size_t)>& fn)
+{
+    std::atomic<size_t> nextIdx(0);
+    auto worker = [&]()
+    {
+        for (size_t idx = nextIdx++; idx < count; idx = nextIdx++)
+            fn(idx);
+    };
+
+    size_t nthreads = std::min(jobs, count);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < nthreads; ++t)
+        threads.push_back(std::thread(worker));
+    for (auto& thread : threads)
+        thread.join();
+}
+
+void BatchIndexer::ScheduledFor(const std::vector<double>& costs, const std::vector<size_t>& memory,
+    size_t memoryBudget, size_t jobs, const std::function<void(size_t)>& fn)
+{
+    size_t count = costs.size();
+    size_t nthreads = std::min(jobs, count);
+    if (nthreads == 0)
+        return;
+
+    std::vector<size_t> order(count);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+    {
+        return costs[a] > costs[b];
+    });
+    // Dealing largest first to the least loaded deque leaves every deque
+    // sorted from most to least expensive.
+    std::vector<std::deque<size_t>> deques(nthreads);
+    std::vector<double> loads(nthreads);
+    for (size_t idx : order)
+    {
+        size_t target = std::min_element(loads.begin(), loads.end()) - loads.begin();
+        loads[target] += std::max(costs[idx], 1e-3);
+        deques[target].push_back(idx);
+    }
+
+    std::mutex mtx;
+    std::condition_variable memoryFreed;
+    size_t memoryInUse = 0;
+    size_t running = 0;
+    auto fits = [&](size_t idx)
+    {
+        return memoryBudget == 0 || running == 0 || memoryInUse + memory[idx] <= memoryBudget;
+    };
+    auto worker = [&](size_t self)
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        for (;;)
+        {
+            // A thread works through its own deque largest first but steals
+            // the cheapest entries, leaving the big ones to their owner.
+            // When the next entry does not fit in memory, a smaller one may.
+            std::deque<size_t>* source = nullptr;
+            bool takeFront = false;
+            bool anyLeft = false;
+            std::deque<size_t>& own = deques[self];
+            if (!own.empty())
+            {
+                anyLeft = true;
+                if (fits(own.front()))
+                {
+                    source = &own;
+                    takeFront = true;
+                }
+                else if (fits(own.back()))
+                    source = &own;
+            }
+            for (size_t step = 1; source == nullptr && step < nthreads; ++step)
+            {
+                std::deque<size_t>& victim = deques[(self + step) % nthreads];
+                if (victim.empty())
+                    continue;
+                anyLeft = true;
+                if (fits(victim.back()))
+                    source = &victim;
+            }
+            if (!anyLeft)
+                return;
+            if (source == nullptr)
+            {
+                memoryFreed.wait(lock);
+                continue;
+            }
+
+            size_t idx = takeFront ? source->front() : source->back();
+            if (takeFront)
+                source->pop_front();
+            else
+                source->pop_back();
+            running++;
+            memoryInUse += memory[idx];
+            lock.unlock();
+            fn(idx);
+            lock.lock();
+            running--;
+            memoryInUse -= memory[idx];
+            memoryFreed.notify_all();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < nthreads; ++t)
+        threads.push_back(std::thread(worker, t));
+    for (auto& thread : threads)
+        thread.join();
+}
+
+void BatchIndexer::ScheduleCommands(const std::vector<CompileCommand>& commands,
+    const IndexHistory& history, const std::function<void(size_t)>& fn) const
+{
+    std::vector<double> costs(commands.size());
+    std::vector<size_t> memory(commands.size());
+    std::vector<uintmax_t> fileSizes(commands.size());
+    std::vector<bool> known(commands.size());
+    double knownMs = 0;
+    uintmax_t knownBytes = 0;
+    size_t knownMemory = 0;
+    size_t knownCount = 0;
+    for (size_t idx = 0; idx < commands.size(); ++idx)
+    {
+        std::error_code ec;
+        uintmax_t size = std::filesystem::file_size(commands[idx].file, ec);
+        fileSizes[idx] = ec ? 0 : size;
+        IndexHistory::Entry entry;
+        if (!history.Find(commands[idx], entry))
+            continue;
+        known[idx] = true;
+        costs[idx] = entry.TotalMs();
+        memory[idx] = IndexHistory::EstimateBytes(entry.nodeCount);
+        knownMs += costs[idx];
+        knownBytes += fileSizes[idx];
+        knownMemory += memory[idx];
+        knownCount++;
+    }
+
+    // File sizes are turned into milliseconds at the rate the known TUs
+    // took, so new TUs slot in among the measured ones.
+    double msPerByte = knownBytes > 0 ? knownMs / knownBytes : 1.0;
+    size_t averageMemory = knownCount > 0 ? knownMemory / knownCount : 0;
+    for (size_t idx = 0; idx < commands.size(); ++idx)
+    {
+        if (known[idx])
+            continue;
+        costs[idx] = fileSizes[idx] * msPerByte;
+        memory[idx] = averageMemory;
+    }
+    ScheduledFor(costs, memory, m_options.maxMemory, m_options.jobs, fn);
+}
+
+std::string BatchIndexer::HistoryPath() const
+{
+    if (!m_options.historyFile.empty())
+        return m_options.historyFile;
+    if (!m_options.outDir.empty())
+        return (std::filesystem::path(m_options.outDir) / "index-history.tsv").string();
+    return m_options.mergedOutput + ".history";
+}
+
+std::string BatchIndexer::PchDir() const
+{
+    if (!m_options.outDir.empty())
+        return (std::filesystem::path(m_options.outDir) / "pch").string();
+    return m_options.mergedOutput + ".pch";
+}
+
+std::vector<std::string> BatchIndexer::BuildSharedPchs(IndexSession& session,
+    const std::vector<CompileCommand>& commands, const DbSink& sink)
+{
+    std::vector<std::string> pchForCommand(commands.size());
+
+    // Only TUs with identical flags can share a PCH.
+    std::map<std::string, std::vector<size_t>> groups;
+    for (size_t idx = 0; idx < commands.size(); ++idx)
+    {
+        std::string key;
+        for (const std::string& arg : commands[idx].arguments)
+            key += arg + '\x1f';
+        groups[key].push_back(idx);
+    }
+
+    struct PchJob
+    {
+        std::vector<size_t> members;
+        std::vector<std::string> includes;
+        std::string header;
+        std::string pch;
+    };
+    std::vector<PchJob> jobs;
+    for (auto& kv : groups)
+    {
+        if (kv.second.size() < 2)
+            continue;
+        // The PCH build below uses GCC style -x, which clang-cl rejects.
+        const std::vector<std::string>& groupArgs = commands[kv.second[0]].arguments;
+        if (std::find(groupArgs.begin(), groupArgs.end(), "--driver-mode=cl") != groupArgs.end())
+            continue;
+        std::vector<std::string> common = LeadingIncludes(commands[kv.second[0]].file);
+        for (size_t m = 1; m < kv.second.size() && !common.empty(); ++m)
+        {
+            std::vector<std::string> includes = LeadingIncludes(commands[kv.second[m]].file);
+            size_t len = 0;
+            while (len < common.size() && len < includes.size() && common[len] == includes[len])
+                len++;
+            common.resize(len);
+        }
+        if (common.empty())
+            continue;
+
+        std::string hashSrc = kv.first;
+        for (const std::string& inc : common)
+            hashSrc += inc;
+        std::string base = fmt::format("pch.{:016x}", (uint64_t)std::hash<std::string>{}(hashSrc));
+        std::filesystem::path pchDir = PchDir();
+        std::filesystem::create_directories(pchDir);
+
+        PchJob job;
+        job.members = kv.second;
+        job.includes = common;
+        job.header = (pchDir / (base + ".h")).string();
+        job.pch = (pchDir / (base + ".pch")).string();
+        jobs.push_back(job);
+    }
+
+    ParallelFor(jobs.size(), m_options.jobs, [&](size_t idx)
+    {
+        PchJob& job = jobs[idx];
+        const CompileCommand& first = commands[job.members[0]];
+        std::string contents;
+        for (const std::string& inc : job.includes)
+            contents += "#include " + inc + "\n";
+        // Leave an unchanged header alone so a PCH restored from the cache
+        // still matches it.
+        std::string existing;
+        {
+            std::ifstream header(job.header, std::ios::in | std::ios::binary);
+            existing.assign(std::istreambuf_iterator<char>(header), std::istreambuf_iterator<char>());
+        }
+        if (existing != contents)
+        {
+            std::ofstream header(job.header, std::ios::out | std::ios::binary);
+            header << contents;
+        }
+
+        std::vector<std::string> args = first.arguments;
+        args.push_back("-x");
+        args.push_back(std::filesystem::path(first.file).extension() == ".c" ? "c-header" : "c++-header");
+        // Cached PCHs are reused by content; without timestamps clang only
+        // rejects one whose inputs changed size.
+        args.push_back("-Xclang");
+        args.push_back("-fno-pch-timestamp");
+        std::vector<std::string> none;
+        std::filesystem::remove(job.pch);
+        // The PCH translation unit is written like any other TU so the headers
+        // it covers are still indexed, exactly once.
+        std::string outPath = (std::filesystem::path(m_options.outDir) /
+            (std::filesystem::path(job.header).stem().string() + ".osy")).string();
+        try
+        {
+            if (sink)
+            {
+                sink(session.CompileToDb(job.header, none, none, args,
+                    true, job.pch, m_options.rootDir, m_options.loggingFlags));
+            }
+            else
+            {
+                session.Compile(job.header, outPath, none, none, args,
+                    true, job.pch, m_options.rootDir, m_options.loggingFlags);
+            }
+        }
+        catch (std::exception& ex)
+        {
+            std::cout << "Error: " << job.header << " " << ex.what() << std::endl;
+        }
+        if (!std::filesystem::exists(job.pch) || session.GetPchCache(job.pch).pchFiles.empty())
+            return;
+        for (size_t member : job.members)
+            pchForCommand[member] = job.pch;
+    });
+
+    return pchForCommand;
+}
+
+size_t BatchIndexer::RunFused(IndexSession& session, const std::vector<CompileCommand>& commands,
+    IndexHistory& history)
+{
+    // Finished TUs go straight to one merger thread; the queue bound keeps
+    // workers from piling up DbFiles faster than they can be merged.
+    BoundedQueue<std::unique_ptr<DbFile>> queue(2 * m_options.jobs);
+    DbFile merged;
+    size_t mergedCount = 0;
+    std::thread merger([&]()
+    {
+        std::unique_ptr<DbFile> tuDb;
+        while (queue.Pop(tuDb))
+        {
+            merged.Merge(*tuDb);
+            mergedCount++;
+        }
+    });
+    DbSink sink = [&](std::unique_ptr<DbFile> tuDb)
+    {
+        if (tuDb != nullptr)
+            queue.Push(std::move(tuDb));
+    };
+
+    std::vector<std::string> pchForCommand = m_options.autoPch ?
+        BuildSharedPchs(session, commands, sink) : std::vector<std::string>(commands.size());
+
+    std::atomic<size_t> failed(0);
+    ScheduleCommands(commands, history, [&](size_t idx)
+    {
+        const CompileCommand& cmd = commands[idx];
+        std::vector<std::string> none;
+        std::unique_ptr<DbFile> tuDb;
+        IndexSession::TUInfo info;
+        try
+        {
+            tuDb = session.CompileToDb(cmd.file, none, none, cmd.arguments,
+                false, pchForCommand[idx], m_options.rootDir, m_options.loggingFlags, &info);
+        }
+        catch (std::exception& ex)
+        {
+            std::cout << "Error: " << cmd.file << " " << ex.what() << std::endl;
+        }
+        if (tuDb == nullptr)
+        {
+            failed++;
+            return;
+        }
+        auto serializeStart = std::chrono::steady_clock::now();
+        if (!m_options.outDir.empty())
+            tuDb->Save(OutputPathFor(m_options.outDir, cmd));
+        IndexHistory::Entry entry;
+        entry.parseMs = info.parseMs;
+        entry.visitMs = info.visitMs;
+        entry.serializeMs = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - serializeStart).count();
+        entry.nodeCount = info.nodeCount;
+        history.Record(cmd, entry);
+        sink(std::move(tuDb));
+    });
+
+    queue.Close();
+    merger.join();
+    std::cout << "Writing " << m_options.mergedOutput << " (" << mergedCount << " translation units)" << std::endl;
+    merged.Save(m_options.mergedOutput);
+    return failed;
+}
+
+size_t BatchIndexer::Run(const std::vector<CompileCommand>& commands)
+{
+    if (!m_options.outDir.empty())
+        std::filesystem::create_directories(m_options.outDir);
+
+    IndexHistory history(HistoryPath());
+    history.Load();
+
+    IndexSession session;
+    session.SetPruneProfile(m_options.pruneProfile);
+    session.SetScopePolicy(m_options.scopePolicy);
+    if (!m_options.mergedOutput.empty())
+    {
+        session.SetShareHeaders(m_options.shareHeaders);
+        size_t failed = RunFused(session, commands, history);
+        history.Save();
+        return failed;
+    }
+
+    std::unique_ptr<CompileCache> cache;
+    if (!m_options.cacheDir.empty())
+    {
+        cache.reset(new CompileCache(m_options.cacheDir));
+        session.SetCompileCache(cache.get());
+    }
+    // A cached output has to stand on its own, so it cannot rely on another
+    // TU of this particular run having indexed its headers.
+    session.SetShareHeaders(m_options.shareHeaders && cache == nullptr);
+    std::vector<std::string> pchForCommand = m_options.autoPch ?
+        BuildSharedPchs(session, commands, DbSink()) : std::vector<std::string>(commands.size());
+
+    std::atomic<size_t> failed(0);
+    ScheduleCommands(commands, history, [&](size_t idx)
+    {
+        const CompileCommand& cmd = commands[idx];
+        std::string outPath = OutputPathFor(m_options.outDir, cmd);
+        std::vector<std::string> none;
+        std::filesystem::remove(outPath);
+        IndexSession::TUInfo info;
+        try
+        {
+            session.Compile(cmd.file, outPath, none, none, cmd.arguments,
+                false, pchForCommand[idx], m_options.rootDir, m_options.loggingFlags, &info);
+        }
+        catch (std::exception& ex)
+        {
+            std::cout << "Error: " << cmd.file << " " << ex.what() << std::endl;
+        }
+        if (!std::filesystem::exists(outPath))
+        {
+            failed++;
+            return;
+        }
+        // A cache hit measured nothing and keeps the earlier entry.
+        if (info.nodeCount > 0)
+        {
+            IndexHistory::Entry entry;
+            entry.parseMs = info.parseMs;
+            entry.visitMs = info.visitMs;
+            entry.serializeMs = info.serializeMs;
+            entry.nodeCount = info.nodeCount;
+            history.Record(cmd, entry);
+        }
+    });
+    history.Save();
+
+    if (cache != nullptr)
+        std::cout << "Cache: " << cache->Hits() << " hits, " << cache->Misses() << " misses" << std::endl;
+    return failed;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <memory>
+#include "CompileDb.h"
+
+class IndexSession;
+class DbFile;
+class IndexHistory;
+class PruneProfile;
+class ScopePolicy;
+
+class BatchIndexer
+{
+public:
+    struct Options
+    {
+        std::string outDir;
+        std::string rootDir;
+        size_t jobs = 1;
+        int loggingFlags = 0;
+        // Index each header only in the first TU that reaches it.
+        bool shareHeaders = true;
+        // Build and use a PCH for groups of TUs with the same flags and a
+        // common run of leading #includes.
+        bool autoPch = true;
+        // Reuse .osy outputs from this directory when nothing they were
+        // built from has changed.
+        std::string cacheDir;
+        // Merge every TU into this one file in process instead of writing
+        // one file per TU. outDir, if set, still receives the per-TU files.
+        std::string mergedOutput;
+        // Per-TU timings and node counts from earlier runs; translation units
+        // are started most expensive first. Defaults to a file in outDir.
+        std::string historyFile;
+        // Estimated memory that the translation units being indexed at once
+        // may use, or 0 for no limit.
+        size_t maxMemory = 0;
+        // Cursor kinds to leave out of the index; null keeps everything.
+        std::shared_ptr<const PruneProfile> pruneProfile;
+        std::shared_ptr<const ScopePolicy> scopePolicy;
+    };
+
+    BatchIndexer(const Options& options);
+
+    // Indexes every command on a pool of worker threads, writing one .osy
+    // per translation unit into the output directory. Returns the number of
+    // translation units that failed to parse.
+    size_t Run(const std::vector<CompileCommand>& commands);
+
+    static std::string OutputPathFor(const std::string& outDir, const CompileCommand& cmd);
+
+    // Picks the commands of shard index out of count. Commands go largest
+    // first to the least loaded shard, using the size of the source file as
+    // the cost estimate, so every machine computes the same partition from
+    // the same compile database.
+    static std::vector<CompileCommand> SelectShard(const std::vector<CompileCommand>& commands,
+        size_t index, size_t count);
+
+    // Runs fn(0..count-1) on up to jobs threads.
+    static void ParallelFor(size_t count, size_t jobs, const std::function<void(size_t)>& fn);
+
+    // Runs fn(0..count-1) on up to jobs threads, most expensive first. The
+    // indices are dealt out by cost to one deque per thread; a thread takes
+    // from the front of its own deque and, once that is empty, steals the
+    // cheapest entry of another. An index only starts while the memory of
+    // those already running plus its own fits in memoryBudget (0 for no
+    // limit), but one always runs, so an oversized index cannot stall.
+    static void ScheduledFor(const std::vector<double>& costs, const std::vector<size_t>& memory,
+        size_t memoryBudget, size_t jobs, const std::function<void(size_t)>& fn);
+
+private:
+    typedef std::function<void(std::unique_ptr<DbFile>)> DbSink;
+
+    // Returns the PCH each command should be parsed with, or an empty
+    // string when the command shares no prefix with others. With a sink, the
+    // PCH translation units go to it instead of to .osy files.
+    std::vector<std::string> BuildSharedPchs(IndexSession& session,
+        const std::vector<CompileCommand>& commands, const DbSink& sink);
+
+    size_t RunFused(IndexSession& session, const std::vector<CompileCommand>& commands,
+        IndexHistory& history);
+    std::string PchDir() const;
+    std::string HistoryPath() const;
+
+    // Runs fn for every command through ScheduledFor, with costs and memory
+    // estimates taken from the history. TUs without history are costed by
+    // their file size and assumed to need the average known memory.
+    void ScheduleCommands(const std::vector<CompileCommand>& commands, const IndexHistory& history,
+        const std::function<void(size_t)>& fn) const;
+
+    Options m_options;
+};
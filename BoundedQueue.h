@@ -0,0 +1,60 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+// A blocking FIFO with a fixed capacity for handing work between threads.
+// Push waits while the queue is full, which throttles producers to the pace
+// of the consumer; Pop waits while it is empty and returns false once the
+// queue is closed and drained.
+template <typename T>
+class BoundedQueue
+{
+    std::mutex m_mtx;
+    std::condition_variable m_notFull;
+    std::condition_variable m_notEmpty;
+    std::deque<T> m_items;
+    size_t m_capacity;
+    bool m_closed = false;
+
+public:
+    BoundedQueue(size_t capacity) :
+        m_capacity(capacity > 0 ? capacity : 1)
+    {
+    }
+
+    void Push(T item)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mtx);
+            m_notFull.wait(lock, [this]() { return m_items.size() < m_capacity; });
+            m_items.push_back(std::move(item));
+        }
+        m_notEmpty.notify_one();
+    }
+
+    bool Pop(T& item)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mtx);
+            m_notEmpty.wait(lock, [this]() { return m_closed || !m_items.empty(); });
+            if (m_items.empty())
+                return false;
+            item = std::move(m_items.front());
+            m_items.pop_front();
+        }
+        m_notFull.notify_one();
+        return true;
+    }
+
+    // No more items will be pushed; wakes consumers once the queue drains.
+    void Close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_closed = true;
+        }
+        m_notEmpty.notify_all();
+    }
+};
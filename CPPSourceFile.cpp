@@ -5,10 +5,6 @@
 
 
 
-std::atomic<int64_t> CPPSourceFile::nextKey(1);
-std::atomic<int64_t> Error::nextKey(1);
-
-
 CPPSourceFile::CPPSourceFile()
 {
     IsDirty = true;
@@ -43,13 +39,13 @@ std::time_t GetFileWriteTime(const std::filesystem::path& filename)
 #endif
 }
 
-CPPSourceFile::CPPSourceFile(std::string fullPath)
+CPPSourceFile::CPPSourceFile(std::string fullPath, int64_t key)
 {
     FullPath = CPPSourceFile::FixPathSlashes(fullPath);
     std::filesystem::path p(FullPath);
     std::time_t cftime = GetFileWriteTime(p);
     Modified = cftime;
-    Key = nextKey++;
+    Key = key;
     hash = std::hash<std::string>{}(FullPath);
     IsDirty = true;
 }
@@ -15,7 +15,6 @@ class CPPSourceFile
 {
 public:
     std::string Name();
-    static std::atomic<int64_t> nextKey;
     int64_t Key;
     std::string FullPath;
     int64_t nodeKey;
@@ -26,7 +25,7 @@ public:
     size_t hash;
 
     CPPSourceFile();
-    CPPSourceFile(std::string fullPath);
+    CPPSourceFile(std::string fullPath, int64_t key);
     size_t Hash() const;
 
     static std::string FormatPath(const std::string& filepath);
@@ -56,7 +55,6 @@ inline bool operator== (const CPPSourceFile& lhs, const CPPSourceFile& rhs)
 class Error : public std::enable_shared_from_this<Error>
 {
 public:
-    static std::atomic<int64_t> nextKey;
     int64_t Key;
     unsigned int Line;
     unsigned int Column;
@@ -0,0 +1,247 @@
+#include "Precomp.h"
+#include "CompileCache.h"
+#include "DbMgr.h"
+#include "Node.h"
+#define FMT_HEADER_ONLY
+#include "fmt/format.h"
+#include <filesystem>
+#include <functional>
+#include <thread>
+#include <random>
+
+namespace
+{
+    // Two independent 64 bit streams; 128 bits keeps accidental collisions
+    // out of the picture for any realistic cache size.
+    struct ContentHash
+    {
+        uint64_t h1 = 14695981039346656037ULL;
+        uint64_t h2 = 0x9E3779B97F4A7C15ULL;
+
+        void Add(const void* data, size_t len)
+        {
+            const uint8_t* bytes = (const uint8_t*)data;
+            for (size_t idx = 0; idx < len; ++idx)
+            {
+                h1 = (h1 ^ bytes[idx]) * 1099511628211ULL;
+                h2 = (h2 + bytes[idx]) * 0xff51afd7ed558ccdULL;
+                h2 ^= h2 >> 29;
+            }
+        }
+
+        void Add(const std::string& str)
+        {
+            uint64_t len = str.size();
+            Add(&len, sizeof(len));
+            Add(str.data(), str.size());
+        }
+
+        std::string Hex() const
+        {
+            return fmt::format("{:016x}{:016x}", h1, h2);
+        }
+    };
+
+    bool HashFileContents(const std::string& path, ContentHash& hash)
+    {
+        std::ifstream ifstream(path, std::ios::in | std::ios::binary);
+        if (!ifstream)
+            return false;
+        std::vector<char> buffer(1 << 16);
+        while (ifstream)
+        {
+            ifstream.read(buffer.data(), buffer.size());
+            hash.Add(buffer.data(), (size_t)ifstream.gcount());
+        }
+        return true;
+    }
+
+    void WriteAtomically(const std::string& path, const std::function<void(const std::string&)>& write)
+    {
+        // Thread ids repeat across processes sharing a cache directory, so
+        // the name also carries a random per-process token.
+        static const uint64_t processToken =
+            ((uint64_t)std::random_device{}() << 32) ^ std::random_device{}();
+        std::string tmpPath = fmt::format("{}.{:x}.{:x}.tmp", path, processToken,
+            (uint64_t)std::hash<std::thread::id>{}(std::this_thread::get_id()));
+        write(tmpPath);
+        std::error_code ec;
+        std::filesystem::rename(tmpPath, path, ec);
+        if (ec)
+            std::filesystem::remove(tmpPath, ec);
+    }
+
+    // The destination is always replaced, never written through, so sharing
+    // the cache entry's inode is safe.
+    bool LinkOrCopy(const std::string& from, const std::string& to)
+    {
+        std::error_code ec;
+        std::filesystem::remove(to, ec);
+        std::filesystem::create_hard_link(from, to, ec);
+        if (!ec)
+            return true;
+        ec.clear();
+        std::filesystem::copy_file(from, to, std::filesystem::copy_options::overwrite_existing, ec);
+        return !ec;
+    }
+}
+
+CompileCache::CompileCache(const std::string& cacheDir) :
+    m_cacheDir(cacheDir),
+    m_toolVersion(fmt::format("osy {} {}", DbFile::FormatVersion, Str(clang_getClangVersion()))),
+    m_hits(0),
+    m_misses(0)
+{
+    std::filesystem::create_directories(m_cacheDir);
+}
+
+std::string CompileCache::PathFor(const std::string& key, const std::string& ext)
+{
+    std::filesystem::path dir = std::filesystem::path(m_cacheDir) / key.substr(0, 2);
+    std::filesystem::create_directories(dir);
+    return (dir / (key + ext)).string();
+}
+
+std::string CompileCache::FileHash(const std::string& path)
+{
+    std::error_code ec;
+    auto mtime = std::filesystem::last_write_time(path, ec);
+    if (ec)
+        return std::string();
+    uintmax_t size = std::filesystem::file_size(path, ec);
+    int64_t stamp = (int64_t)mtime.time_since_epoch().count();
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        auto itHash = m_fileHashes.find(path);
+        if (itHash != m_fileHashes.end() &&
+            std::get<0>(itHash->second) == stamp &&
+            std::get<1>(itHash->second) == size)
+            return std::get<2>(itHash->second);
+    }
+
+    ContentHash hash;
+    if (!HashFileContents(path, hash))
+        return std::string();
+    std::string hex = hash.Hex();
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_fileHashes[path] = std::make_tuple(stamp, size, hex);
+    return hex;
+}
+
+std::string CompileCache::BaseKey(const std::string& fname, const std::vector<std::string>& args,
+    const std::vector<std::string>& extraInputs)
+{
+    std::string mainHash = FileHash(fname);
+    if (mainHash.empty())
+        return std::string();
+    ContentHash hash;
+    hash.Add(m_toolVersion);
+    hash.Add(fname);
+    hash.Add(mainHash);
+    for (const std::string& arg : args)
+        hash.Add(arg);
+    for (const std::string& input : extraInputs)
+    {
+        std::string inputHash = FileHash(input);
+        if (inputHash.empty())
+            return std::string();
+        hash.Add(input);
+        hash.Add(inputHash);
+    }
+    return hash.Hex();
+}
+
+std::string CompileCache::EntryKey(const std::string& baseKey, const std::vector<std::string>& inclusions)
+{
+    ContentHash hash;
+    hash.Add(baseKey);
+    for (const std::string& inc : inclusions)
+    {
+        std::string incHash = FileHash(inc);
+        if (incHash.empty())
+            return std::string();
+        hash.Add(inc);
+        hash.Add(incHash);
+    }
+    return hash.Hex();
+}
+
+bool CompileCache::Fetch(const std::string& baseKey, const std::string& outpath,
+    const std::string& pchpath, std::vector<std::string>* inclusionsOut)
+{
+    if (baseKey.empty())
+    {
+        m_misses++;
+        return false;
+    }
+
+    std::vector<std::string> inclusions;
+    {
+        std::ifstream manifest(PathFor(baseKey, ".manifest"));
+        std::string line;
+        if (!manifest || !std::getline(manifest, line))
+        {
+            m_misses++;
+            return false;
+        }
+        while (std::getline(manifest, line))
+        {
+            if (!line.empty())
+                inclusions.push_back(line);
+        }
+    }
+
+    std::string entryKey = EntryKey(baseKey, inclusions);
+    std::string entryPath = entryKey.empty() ? std::string() : PathFor(entryKey, ".osy");
+    std::string pchEntryPath = (entryKey.empty() || pchpath.empty()) ?
+        std::string() : PathFor(entryKey, ".pch");
+    if (entryPath.empty() || !std::filesystem::exists(entryPath) ||
+        (!pchpath.empty() && !std::filesystem::exists(pchEntryPath)))
+    {
+        m_misses++;
+        return false;
+    }
+
+    if (!LinkOrCopy(entryPath, outpath) ||
+        (!pchpath.empty() && !LinkOrCopy(pchEntryPath, pchpath)))
+    {
+        m_misses++;
+        return false;
+    }
+    if (inclusionsOut != nullptr)
+        *inclusionsOut = std::move(inclusions);
+    m_hits++;
+    return true;
+}
+
+void CompileCache::Store(const std::string& baseKey, const std::vector<std::string>& inclusions,
+    const std::string& outpath, const std::string& pchpath)
+{
+    if (baseKey.empty() || !std::filesystem::exists(outpath) ||
+        (!pchpath.empty() && !std::filesystem::exists(pchpath)))
+        return;
+    std::string entryKey = EntryKey(baseKey, inclusions);
+    if (entryKey.empty())
+        return;
+
+    // The .pch goes in before the manifest that makes the entry reachable.
+    if (!pchpath.empty())
+    {
+        WriteAtomically(PathFor(entryKey, ".pch"), [&](const std::string& tmpPath)
+        {
+            std::filesystem::copy_file(pchpath, tmpPath, std::filesystem::copy_options::overwrite_existing);
+        });
+    }
+
+    WriteAtomically(PathFor(entryKey, ".osy"), [&](const std::string& tmpPath)
+    {
+        std::filesystem::copy_file(outpath, tmpPath, std::filesystem::copy_options::overwrite_existing);
+    });
+    WriteAtomically(PathFor(baseKey, ".manifest"), [&](const std::string& tmpPath)
+    {
+        std::ofstream manifest(tmpPath);
+        manifest << "osy-cache-manifest 1\n";
+        for (const std::string& inc : inclusions)
+            manifest << inc << "\n";
+    });
+}
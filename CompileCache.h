@@ -0,0 +1,52 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <tuple>
+#include <mutex>
+#include <atomic>
+
+// A local, content addressed cache of .osy outputs, in the spirit of
+// ccache's direct mode. The base key hashes the compiler arguments and the
+// main file; it names a manifest listing the files the TU included last
+// time. The entry key additionally hashes the current contents of those
+// files, so any edit to the TU or anything it includes is a miss.
+class CompileCache
+{
+public:
+    CompileCache(const std::string& cacheDir);
+
+    // Hashes the main file, its arguments and the contents of any extra
+    // inputs known up front, such as the headers behind a PCH.
+    std::string BaseKey(const std::string& fname, const std::vector<std::string>& args,
+        const std::vector<std::string>& extraInputs);
+
+    // Hard-links (or copies) the cached output for this TU to outpath. A PCH
+    // build also restores its .pch to pchpath and reports the headers it
+    // was built from through inclusions.
+    bool Fetch(const std::string& baseKey, const std::string& outpath,
+        const std::string& pchpath = std::string(), std::vector<std::string>* inclusions = nullptr);
+
+    // Records outpath (and pchpath, for a PCH build) as the result for
+    // baseKey, given the files the TU included.
+    void Store(const std::string& baseKey, const std::vector<std::string>& inclusions,
+        const std::string& outpath, const std::string& pchpath = std::string());
+
+    size_t Hits() const { return m_hits; }
+    size_t Misses() const { return m_misses; }
+
+private:
+    std::string FileHash(const std::string& path);
+    std::string EntryKey(const std::string& baseKey, const std::vector<std::string>& inclusions);
+    std::string PathFor(const std::string& key, const std::string& ext);
+
+    std::string m_cacheDir;
+    // The OSY format version and the libclang version, hashed into every key.
+    std::string m_toolVersion;
+    std::mutex m_mtx;
+    // path -> (mtime, size, content hash), so shared headers are read once per run
+    std::map<std::string, std::tuple<int64_t, uintmax_t, std::string>> m_fileHashes;
+    std::atomic<size_t> m_hits;
+    std::atomic<size_t> m_misses;
+};
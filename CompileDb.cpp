@@ -0,0 +1,285 @@
+#include "Precomp.h"
+#include "CompileDb.h"
+#include <filesystem>
+
+namespace
+{
+    // Minimal JSON reader, just enough for compile_commands.json: an array of
+    // objects whose values are strings or arrays of strings.
+    class JsonReader
+    {
+        const std::string& m_text;
+        size_t m_pos;
+
+        void Fail(const std::string& msg)
+        {
+            throw std::runtime_error("compile database: " + msg + " at offset " + std::to_string(m_pos));
+        }
+
+        void SkipWs()
+        {
+            while (m_pos < m_text.size() && std::isspace((unsigned char)m_text[m_pos]))
+                m_pos++;
+        }
+
+    public:
+        JsonReader(const std::string& text) :
+            m_text(text),
+            m_pos(0) {}
+
+        bool Peek(char c)
+        {
+            SkipWs();
+            return m_pos < m_text.size() && m_text[m_pos] == c;
+        }
+
+        void Expect(char c)
+        {
+            if (!Peek(c))
+                Fail(std::string("expected '") + c + "'");
+            m_pos++;
+        }
+
+        bool Accept(char c)
+        {
+            if (!Peek(c))
+                return false;
+            m_pos++;
+            return true;
+        }
+
+        std::string ReadString()
+        {
+            Expect('"');
+            std::string str;
+            while (m_pos < m_text.size() && m_text[m_pos] != '"')
+            {
+                char c = m_text[m_pos++];
+                if (c != '\\')
+                {
+                    str.push_back(c);
+                    continue;
+                }
+                if (m_pos >= m_text.size())
+                    break;
+                c = m_text[m_pos++];
+                switch (c)
+                {
+                case 'n': str.push_back('\n'); break;
+                case 't': str.push_back('\t'); break;
+                case 'r': str.push_back('\r'); break;
+                case 'b': str.push_back('\b'); break;
+                case 'f': str.push_back('\f'); break;
+                case 'u':
+                {
+                    if (m_pos + 4 > m_text.size())
+                        Fail("bad unicode escape");
+                    unsigned int cp = std::stoul(m_text.substr(m_pos, 4), nullptr, 16);
+                    m_pos += 4;
+                    if (cp < 0x80)
+                        str.push_back((char)cp);
+                    else if (cp < 0x800)
+                    {
+                        str.push_back((char)(0xC0 | (cp >> 6)));
+                        str.push_back((char)(0x80 | (cp & 0x3F)));
+                    }
+                    else
+                    {
+                        str.push_back((char)(0xE0 | (cp >> 12)));
+                        str.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+                        str.push_back((char)(0x80 | (cp & 0x3F)));
+                    }
+                    break;
+                }
+                default: str.push_back(c); break;
+                }
+            }
+            Expect('"');
+            return str;
+        }
+
+        // Skips over any value we do not care about (numbers, bools, nested objects).
+        void SkipValue()
+        {
+            SkipWs();
+            if (Peek('"'))
+                ReadString();
+            else if (Accept('['))
+            {
+                if (!Accept(']'))
+                {
+                    do { SkipValue(); } while (Accept(','));
+                    Expect(']');
+                }
+            }
+            else if (Accept('{'))
+            {
+                if (!Accept('}'))
+                {
+                    do { ReadString(); Expect(':'); SkipValue(); } while (Accept(','));
+                    Expect('}');
+                }
+            }
+            else
+            {
+                while (m_pos < m_text.size() && std::string(",]} \t\r\n").find(m_text[m_pos]) == std::string::npos)
+                    m_pos++;
+            }
+        }
+    };
+
+    std::string Absolute(const std::string& dir, const std::string& path)
+    {
+        std::filesystem::path p(path);
+        if (p.is_relative() && !dir.empty())
+            p = std::filesystem::path(dir) / p;
+        return p.lexically_normal().string();
+    }
+}
+
+std::vector<std::string> CompileDb::SplitCommandLine(const std::string& command)
+{
+    std::vector<std::string> args;
+    std::string cur;
+    bool inArg = false;
+    char quote = 0;
+    for (size_t idx = 0; idx < command.size(); ++idx)
+    {
+        char c = command[idx];
+        if (quote != 0)
+        {
+            if (c == quote)
+                quote = 0;
+            else if (c == '\\' && quote == '"' && idx + 1 < command.size() &&
+                (command[idx + 1] == '"' || command[idx + 1] == '\\'))
+                cur.push_back(command[++idx]);
+            else
+                cur.push_back(c);
+        }
+        else if (c == '"' || c == '\'')
+        {
+            quote = c;
+            inArg = true;
+        }
+        // Outside quotes a backslash only escapes a quote or a backslash, as
+        // on Windows command lines, so paths like C:\src\a.cpp survive.
+        else if (c == '\\' && idx + 1 < command.size() &&
+            (command[idx + 1] == '"' || command[idx + 1] == '\'' || command[idx + 1] == '\\'))
+        {
+            cur.push_back(command[++idx]);
+            inArg = true;
+        }
+        else if (std::isspace((unsigned char)c))
+        {
+            if (inArg)
+                args.push_back(cur);
+            cur.clear();
+            inArg = false;
+        }
+        else
+        {
+            cur.push_back(c);
+            inArg = true;
+        }
+    }
+    if (inArg)
+        args.push_back(cur);
+    return args;
+}
+
+std::vector<CompileCommand> CompileDb::Load(const std::string& path)
+{
+    std::ifstream ifstream(path, std::ios::in | std::ios::binary);
+    if (!ifstream)
+        throw std::runtime_error("compile database: cannot open " + path);
+    std::stringstream buffer;
+    buffer << ifstream.rdbuf();
+    std::string text = buffer.str();
+
+    std::vector<CompileCommand> commands;
+    JsonReader reader(text);
+    reader.Expect('[');
+    if (reader.Accept(']'))
+        return commands;
+    do
+    {
+        CompileCommand cmd;
+        std::vector<std::string> rawArgs;
+        reader.Expect('{');
+        if (!reader.Accept('}'))
+        {
+            do
+            {
+                std::string key = reader.ReadString();
+                reader.Expect(':');
+                if (key == "directory")
+                    cmd.directory = reader.ReadString();
+                else if (key == "file")
+                    cmd.file = reader.ReadString();
+                else if (key == "output")
+                    cmd.output = reader.ReadString();
+                else if (key == "command")
+                    rawArgs = SplitCommandLine(reader.ReadString());
+                else if (key == "arguments")
+                {
+                    rawArgs.clear();
+                    reader.Expect('[');
+                    if (!reader.Accept(']'))
+                    {
+                        do { rawArgs.push_back(reader.ReadString()); } while (reader.Accept(','));
+                        reader.Expect(']');
+                    }
+                }
+                else
+                    reader.SkipValue();
+            } while (reader.Accept(','));
+            reader.Expect('}');
+        }
+
+        cmd.file = Absolute(cmd.directory, cmd.file);
+
+        // libclang parses GCC style unless told otherwise; without this, /I
+        // and /D of an MSVC command would be taken for input files.
+        if (!rawArgs.empty())
+        {
+            std::string driver = rawArgs[0].substr(rawArgs[0].find_last_of("/\\") + 1);
+            std::transform(driver.begin(), driver.end(), driver.begin(),
+                [](unsigned char c) { return (char)std::tolower(c); });
+            if (driver.ends_with(".exe"))
+                driver.resize(driver.size() - 4);
+            if (driver == "cl" || driver == "clang-cl")
+                cmd.arguments.push_back("--driver-mode=cl");
+        }
+
+        // Drop the compiler executable, the source file itself and output
+        // related options, GCC and MSVC style; everything else is passed
+        // through unchanged.
+        for (size_t idx = 1; idx < rawArgs.size(); ++idx)
+        {
+            const std::string& arg = rawArgs[idx];
+            if (arg == "-c" || arg == "/c" || arg == "--")
+                continue;
+            if (arg == "-o" || arg == "-MF" || arg == "-MT" || arg == "-MQ" ||
+                arg == "/Fo:" || arg == "/Fd:")
+            {
+                idx++;
+                continue;
+            }
+            if (arg == "-MD" || arg == "-MMD")
+                continue;
+            // -o<path>, but not options like -objcmt-*.
+            if (arg.size() > 2 && arg.starts_with("-o") && !arg.starts_with("-obj"))
+                continue;
+            if (arg.starts_with("/Fo") || arg.starts_with("/Fd"))
+                continue;
+            if (arg[0] != '-' && Absolute(cmd.directory, arg) == cmd.file)
+                continue;
+            cmd.arguments.push_back(arg);
+        }
+        if (!cmd.directory.empty())
+            cmd.arguments.push_back("-working-directory=" + cmd.directory);
+        commands.push_back(cmd);
+    } while (reader.Accept(','));
+    reader.Expect(']');
+    return commands;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// One entry of a clang compile_commands.json database.
+struct CompileCommand
+{
+    std::string directory;
+    std::string file;
+    std::string output;
+    // Full compiler argument list with the compiler executable, the source
+    // file and the -c/-o pairs stripped out, plus -working-directory so that
+    // relative paths resolve the same way the build does. Commands for
+    // cl.exe or clang-cl start with --driver-mode=cl.
+    std::vector<std::string> arguments;
+};
+
+class CompileDb
+{
+public:
+    static std::vector<CompileCommand> Load(const std::string& path);
+    static std::vector<std::string> SplitCommandLine(const std::string& command);
+};
@@ -13,7 +13,6 @@
 #include "clang-c/BuildSystem.h"
 #include "clang-c/Index.h"
 
-class TypeNode;
 class Compiler
 {
     class Timer
@@ -27,37 +26,13 @@ class Compiler
     };
 
 public:
-    struct ProjectCache
-    {
-        std::set<std::string> pchFiles;
-        //std::mutex allNodesMtx;
-    };
-
-private:
-    static Compiler* m_sInstance;
-
-    CXTranslationUnit CompileInternal(const std::string& fname, 
-        const std::string &outpath, const std::vector<std::string>& includes,
-        const std::vector<std::string>& defines, const std::vector<std::string>& miscArgs, 
-        ProjectCache &pc, bool buildPch, const std::string& usePch, 
-        const std::string& rootdir, int loggingFlags);
-
-    std::vector<std::string> GenerateCompileArgs(const std::string& fname,
-        const std::string& outpath, const std::vector<std::string>& includes,
-        const std::vector<std::string>& defines, const std::vector<std::string>& miscArgs,
-        ProjectCache& pc, bool buildPch, const std::string& usePch, 
-        const std::string& rootdir, int loggingFlags);
-
-    void AddTypeNodes(std::function<size_t (const std::string &tokenStr)> addToken,
-        std::vector<Node>& newNodes0,
-        std::vector<TypeNode> &typeNodes);
-public:
-    static Compiler* Inst();
-
-    std::vector<uint8_t> CompileWithArgs(const std::string& fname,        
+    // Convenience wrappers that index a single translation unit in a private
+    // IndexSession. Embedders that index several files, possibly on several
+    // threads, should hold an IndexSession directly.
+    static std::vector<uint8_t> CompileWithArgs(const std::string& fname,        
         const std::vector<std::string>& args, int loggingFlags);
 
-    std::vector<uint8_t> Compile(const std::string& fname,
+    static std::vector<uint8_t> Compile(const std::string& fname,
         const std::string& outpath, const std::vector<std::string>& includes,
         const std::vector<std::string>& defines,
         const std::vector<std::string>& miscArgs,
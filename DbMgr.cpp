@@ -55,7 +55,9 @@ CPPSourceFilePtr DbFile::GetOrInsertFile(const std::string& commitName, const st
             if (fileName.empty())
                 return nullptr;
 
-            sf = new CPPSourceFile(fileName);
+            // Keys are numbered per DbFile so a translation unit's file table
+            // does not depend on what else was indexed in the process.
+            sf = new CPPSourceFile(fileName, (int64_t)m_sourceFiles.size() + 1);
             m_sourceFiles[commitName] = sf;
         }
         else
@@ -76,23 +78,34 @@ DbNode::DbNode(const Node& n) :
     column(n.Column),
     startOffset(n.StartOffset),
     endOffset(n.EndOffset),
-    // Bits (0-3) - AccessSpecifier, 4 - IsAbstract, (5-8) - StorageClass, 9 - IsDeleted
-    flags(((n.AcessSpecifier) & 0x03) | (n.isAbstract ? 4 : 0) | (n.StorageClass << 3) |
-        (n.isDeleted ? (1 << 9) : 0)),
+    flags(MakeFlags(n.AcessSpecifier, n.isAbstract, n.StorageClass, n.isDeleted)),
     sourceFile(n.SourceFile != nullptr ? n.SourceFile->Key : nullnode)
 {
 
 }
 
-void DbFile::AddNodes(std::vector<Node>& nodes)
+int32_t DbNode::MakeFlags(CX_CXXAccessSpecifier access, bool isAbstract,
+    CX_StorageClass storageClass, bool isDeleted)
+{
+    // Bits (0-3) - AccessSpecifier, 4 - IsAbstract, (5-8) - StorageClass, 9 - IsDeleted
+    return (access & 0x03) | (isAbstract ? 4 : 0) | (storageClass << 3) |
+        (isDeleted ? (1 << 9) : 0);
+}
+
+void DbFile::AddNodes(std::vector<DbNode>& nodes)
 {
-    size_t idx = 0;
-    for (Node& t : nodes)
+    // A visited translation unit is the only batch, so its table is kept.
+    if (m_dbNodes.empty())
+        m_dbNodes.swap(nodes);
+    else
     {
-        t.Key = m_dbNodes.size();
-        t.ParentNodeIdx = t.ParentNodeIdx;
-        t.ReferencedIdx = t.ReferencedIdx;
-        m_dbNodes.push_back(DbNode(t));
+        m_dbNodes.reserve(m_dbNodes.size() + nodes.size());
+        for (DbNode& node : nodes)
+        {
+            node.key = m_dbNodes.size();
+            m_dbNodes.push_back(node);
+        }
+        nodes.clear();
     }
 
     RemoveDuplicates();
@@ -103,6 +116,12 @@ DbFile::DbFile()
 {
 }
 
+DbFile::~DbFile()
+{
+    for (auto& kv : m_sourceFiles)
+        delete kv.second;
+}
+
 
 void DbFile::UpdateRow(CPPSourceFilePtr node)
 {
@@ -178,6 +197,11 @@ void DbFile::Save(const std::string& dbfile)
 
     std::vector<uint8_t> data;
     WriteStream(data);
+    SaveStream(dbfile, data);
+}
+
+void DbFile::SaveStream(const std::string& dbfile, const std::vector<uint8_t>& data)
+{
     // Decoded data size (in bytes).
     const uLongf decodedCnt = (uLongf)data.size();
 
@@ -508,40 +532,42 @@ void DbFile::Merge(const DbFile& other)
 
     // DbType merging and remapping
     {
-        std::unordered_map<int64_t, int64_t> uidTypeMap;
+        // Hashes may collide, so a match is only taken if the types agree.
+        std::unordered_multimap<int64_t, int64_t> uidTypeMap;
         uidTypeMap.reserve(m_dbTypes.size());
         size_t typeIdx = 0;
         for (auto& ctype : m_dbTypes)
         {
-            if (ctype.hash == 0)
-                continue;
-            auto ittok = uidTypeMap.find(ctype.hash);
-            if (ittok != uidTypeMap.end())
-                dbgbreak();
-            uidTypeMap.insert(std::make_pair(ctype.hash, typeIdx));
+            if (ctype.hash != 0)
+                uidTypeMap.insert(std::make_pair(ctype.hash, typeIdx));
             typeIdx++;
         }
         typeIdx = 0;
         typeRemapping.resize(other.m_dbTypes.size());
         for (auto& otype : other.m_dbTypes)
         {
-            int64_t tokenIdx = tokenRemapping[otype.token];
-            auto itFoundType = uidTypeMap.find(otype.hash);
-            if (itFoundType == uidTypeMap.end())
+            DbType tn = otype;
+            tn.key = m_dbTypes.size();
+            tn.token = tokenRemapping[otype.token];
+            for (int64_t &child : tn.children)
             {
-                DbType tn = otype;
-                tn.key = m_dbTypes.size();
-                tn.token = tokenIdx;
-                for (int64_t &child : tn.children)
-                {
-                    child = typeRemapping[child];
-                }
-                uidTypeMap.insert(std::make_pair(tn.hash, tn.key));
+                child = typeRemapping[child];
+            }
+            int64_t foundIdx = nullnode;
+            auto range = uidTypeMap.equal_range(tn.hash);
+            for (auto itFoundType = range.first; itFoundType != range.second && foundIdx == nullnode; ++itFoundType)
+            {
+                if (m_dbTypes[itFoundType->second] == tn)
+                    foundIdx = itFoundType->second;
+            }
+            if (foundIdx == nullnode)
+            {
+                if (tn.hash != 0)
+                    uidTypeMap.insert(std::make_pair(tn.hash, tn.key));
                 m_dbTypes.push_back(tn);
-                typeRemapping[typeIdx] = tn.key;
+                foundIdx = tn.key;
             }
-            else
-                typeRemapping[typeIdx] = itFoundType->second;
+            typeRemapping[typeIdx] = foundIdx;
             typeIdx++;
         }
     }
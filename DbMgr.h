@@ -54,6 +54,9 @@ struct DbNode
     bool operator == (const DbNode& other) const;
     DbNode() {}
     DbNode(const Node &);
+
+    static int32_t MakeFlags(CX_CXXAccessSpecifier access, bool isAbstract,
+        CX_StorageClass storageClass, bool isDeleted);
 };
 
 struct DbToken : public CppStreamable
@@ -111,6 +114,15 @@ struct DbType : public CppStreamable
         isconst(_isconst)
     {
 
+    }
+    // Same type, comparing everything but key and hash; children and token
+    // must index the same tables.
+    bool operator == (const DbType& other) const
+    {
+        return kind == other.kind &&
+            isconst == other.isconst &&
+            token == other.token &&
+            children == other.children;
     }
     void WriteBinaryData(ICppStreamWriter& data, void* pUserContext) const override
     {
@@ -148,6 +160,11 @@ class DbHandle;
 
 class CPPEXPORT DbFile
 {
+public:
+    // Bump whenever the rows the indexer writes for a translation unit
+    // change, so outputs cached by an older build are not reused.
+    static constexpr int FormatVersion = 1;
+private:
     std::map<std::string, CPPSourceFilePtr> m_sourceFiles;
     std::vector<DbNode> m_dbNodes;
     std::vector<DbToken> m_dbTokens;
@@ -156,15 +173,21 @@ class CPPEXPORT DbFile
     std::vector<std::string> m_dbSourceFiles;
 public:
     DbFile();
+    ~DbFile();
+    DbFile(const DbFile&) = delete;
+    DbFile& operator=(const DbFile&) = delete;
     void UpdateRow(CPPSourceFilePtr node);
     void AddRowsPtr(std::vector<ErrorPtr>& range);
     int64_t AddRows(std::vector<Token>& range);
     int64_t AddRows(std::vector<TypeNode>& types);
     CPPSourceFilePtr GetOrInsertFile(const std::string& commitName, const std::string& fileName);
-    void AddNodes(std::vector<Node>& range);
+    // Takes the nodes; range is left empty.
+    void AddNodes(std::vector<DbNode>& range);
     void WriteStream(std::vector<uint8_t>& data);
     void CommitSourceFiles();
     void Save(const std::string& dbfile);
+    // Compresses bytes produced by WriteStream into an OSY file.
+    static void SaveStream(const std::string& dbfile, const std::vector<uint8_t>& data);
     void Load(const std::string& dbfile);
     void RemoveDuplicates();
     void Merge(const DbFile& other);
@@ -0,0 +1,518 @@
+#include "Precomp.h"
+#include "CPPSourceFile.h"
+#include "DbMgr.h"
+#include "Node.h"
+#include "cppstream.h"
+#include "ExternalSorter.h"
+#include "ExternalMerge.h"
+#include "zlib.h"
+#include <unordered_map>
+#include <filesystem>
+
+namespace
+{
+    // Inflates an OSY file on demand, so its contents can be read with the
+    // CppStream functions without holding the whole file in memory.
+    class InflateStreamReader : public ICppStreamReader
+    {
+        mutable std::ifstream m_file;
+        mutable z_stream m_zs;
+        mutable std::vector<uint8_t> m_in;
+        mutable std::vector<uint8_t> m_out;
+        mutable size_t m_outPos = 0;
+        mutable size_t m_outEnd = 0;
+        mutable size_t m_pos = 0;
+        std::string m_path;
+
+        void Fill() const
+        {
+            m_zs.next_out = m_out.data();
+            m_zs.avail_out = (uInt)m_out.size();
+            while (m_zs.avail_out == m_out.size())
+            {
+                if (m_zs.avail_in == 0)
+                {
+                    m_file.read((char*)m_in.data(), m_in.size());
+                    m_zs.next_in = m_in.data();
+                    m_zs.avail_in = (uInt)m_file.gcount();
+                }
+                int status = inflate(&m_zs, Z_NO_FLUSH);
+                if (status == Z_STREAM_END && m_zs.avail_out == m_out.size())
+                    throw std::runtime_error("unexpected end of " + m_path);
+                if (status != Z_OK && status != Z_STREAM_END)
+                    throw std::runtime_error("corrupt data in " + m_path);
+            }
+            m_outPos = 0;
+            m_outEnd = m_out.size() - m_zs.avail_out;
+        }
+
+    public:
+        InflateStreamReader(const std::string& path) :
+            m_file(path, std::ios::in | std::ios::binary),
+            m_in(1 << 20),
+            m_out(1 << 20),
+            m_path(path)
+        {
+            if (!m_file)
+                throw std::runtime_error("could not open " + path);
+            uint32_t decodedCnt;
+            m_file.read((char*)&decodedCnt, sizeof(uint32_t));
+            memset(&m_zs, 0, sizeof(m_zs));
+            inflateInit(&m_zs);
+        }
+
+        ~InflateStreamReader()
+        {
+            inflateEnd(&m_zs);
+        }
+
+        void ReadBytes(uint8_t* pOutBytes, size_t count) const override
+        {
+            m_pos += count;
+            while (count > 0)
+            {
+                if (m_outPos == m_outEnd)
+                    Fill();
+                size_t len = std::min(count, m_outEnd - m_outPos);
+                memcpy(pOutBytes, &m_out[m_outPos], len);
+                m_outPos += len;
+                pOutBytes += len;
+                count -= len;
+            }
+        }
+
+        size_t GetPos() const override { return m_pos; }
+    };
+
+    // Writes an OSY file the way DbFile::Save does, but deflates as it goes.
+    // The uncompressed size that leads the file is patched in by Finish. That
+    // field is 32 bits, so a stream that outgrows it is an error.
+    class DeflateStreamWriter : public ICppStreamWriter
+    {
+        std::ofstream m_file;
+        z_stream m_zs;
+        std::vector<uint8_t> m_in;
+        std::vector<uint8_t> m_out;
+        uint64_t m_total = 0;
+        bool m_finished = false;
+
+        void Deflate(int flush)
+        {
+            m_zs.next_in = m_in.data();
+            m_zs.avail_in = (uInt)m_in.size();
+            int status;
+            do
+            {
+                m_zs.next_out = m_out.data();
+                m_zs.avail_out = (uInt)m_out.size();
+                status = deflate(&m_zs, flush);
+                m_file.write((const char*)m_out.data(), m_out.size() - m_zs.avail_out);
+            } while (m_zs.avail_out == 0 || (flush == Z_FINISH && status != Z_STREAM_END));
+            m_in.clear();
+        }
+
+    public:
+        DeflateStreamWriter(const std::string& path) :
+            m_file(path, std::ios::out | std::ios::binary),
+            m_out(1 << 20)
+        {
+            uint32_t decodedCnt = 0;
+            m_file.write((const char*)&decodedCnt, sizeof(uint32_t));
+            memset(&m_zs, 0, sizeof(m_zs));
+            deflateInit(&m_zs, Z_DEFAULT_COMPRESSION);
+            m_in.reserve(1 << 20);
+        }
+
+        ~DeflateStreamWriter()
+        {
+            if (!m_finished)
+                deflateEnd(&m_zs);
+        }
+
+        void AppendBytes(const uint8_t* pBegin, size_t len) override
+        {
+            m_total += len;
+            if (m_total > UINT32_MAX)
+                throw std::runtime_error("merged data exceeds the 4GB size field of the OSY header");
+            m_in.insert(m_in.end(), pBegin, pBegin + len);
+            if (m_in.size() >= (1 << 20))
+                Deflate(Z_NO_FLUSH);
+        }
+
+        size_t GetPos() const override { return m_total; }
+
+        bool Finish()
+        {
+            Deflate(Z_FINISH);
+            deflateEnd(&m_zs);
+            m_finished = true;
+            uint32_t decodedCnt = (uint32_t)m_total;
+            m_file.seekp(0);
+            m_file.write((const char*)&decodedCnt, sizeof(uint32_t));
+            m_file.close();
+            return !m_file.fail();
+        }
+    };
+
+    // One node occurrence. The node's parent and reference are carried as
+    // tree hashes until the final indices are known; parentNodeIdx and
+    // referencedIdx only say whether there is one.
+    struct NodeRecord
+    {
+        uint64_t hash;
+        uint64_t seq;
+        uint64_t parentHash;
+        uint64_t refHash;
+        DbNode node;
+    };
+
+    struct ByHashSeq
+    {
+        bool operator()(const NodeRecord& a, const NodeRecord& b) const
+        {
+            return a.hash != b.hash ? a.hash < b.hash : a.seq < b.seq;
+        }
+    };
+
+    struct BySeq
+    {
+        bool operator()(const NodeRecord& a, const NodeRecord& b) const
+        {
+            return a.seq < b.seq;
+        }
+    };
+
+    struct HashIdx
+    {
+        uint64_t hash;
+        int64_t idx;
+    };
+
+    struct ByHash
+    {
+        bool operator()(const HashIdx& a, const HashIdx& b) const
+        {
+            return a.hash < b.hash;
+        }
+    };
+
+    // A request to resolve hash into a node index for field of node idx.
+    struct LinkRecord
+    {
+        uint64_t hash;
+        int64_t idx;
+        int64_t field;
+    };
+
+    struct ByLinkHash
+    {
+        bool operator()(const LinkRecord& a, const LinkRecord& b) const
+        {
+            if (a.hash != b.hash)
+                return a.hash < b.hash;
+            return a.idx != b.idx ? a.idx < b.idx : a.field < b.field;
+        }
+    };
+
+    struct ByLinkIdx
+    {
+        bool operator()(const LinkRecord& a, const LinkRecord& b) const
+        {
+            return a.idx != b.idx ? a.idx < b.idx : a.field < b.field;
+        }
+    };
+
+    const int64_t ParentField = 0;
+    const int64_t RefField = 1;
+}
+
+size_t ExternalMerge::ParseSize(const std::string& text)
+{
+    char* end = nullptr;
+    double value = strtod(text.c_str(), &end);
+    if (end == text.c_str() || value <= 0)
+        return 0;
+    switch (toupper(*end))
+    {
+    case 'K': value *= 1024.0; break;
+    case 'M': value *= 1024.0 * 1024.0; break;
+    case 'G': value *= 1024.0 * 1024.0 * 1024.0; break;
+    case 'T': value *= 1024.0 * 1024.0 * 1024.0 * 1024.0; break;
+    case '\0': break;
+    default: return 0;
+    }
+    return (size_t)value;
+}
+
+bool ExternalMerge::Run(const std::vector<std::string>& inputs, const std::string& output,
+    const Options& options)
+{
+    std::filesystem::path tempRoot = options.tempDir.empty() ?
+        std::filesystem::temp_directory_path() : std::filesystem::path(options.tempDir);
+    std::filesystem::path tempDir = tempRoot /
+        ("osy-merge-" + std::to_string(std::hash<std::string>{}(output) ^
+            (size_t)std::chrono::steady_clock::now().time_since_epoch().count()));
+    std::filesystem::create_directories(tempDir);
+    // At most three sorters hold a buffer at the same time; each is dropped
+    // as soon as it has been drained.
+    size_t sortBudget = std::max<size_t>(options.maxMemory / 3, 1 << 20);
+
+    std::vector<std::string> sourceFiles;
+    std::unordered_map<std::string, int64_t> sourceMap;
+    std::vector<DbToken> tokens;
+    std::unordered_map<std::string, int64_t> tokenMap;
+    std::vector<DbType> types;
+    std::unordered_multimap<int64_t, int64_t> typeMap;
+    bool ok = true;
+    bool startedOutput = false;
+
+    try
+    {
+        // Pass 1: remap every input into the merged file, token and type
+        // numbering, which the tree hashes depend on, and sort the node
+        // occurrences by tree hash.
+        std::unique_ptr<ExternalSorter<NodeRecord, ByHashSeq>> byHash(
+            new ExternalSorter<NodeRecord, ByHashSeq>(tempDir.string(), "hash", sortBudget));
+        uint64_t seq = 0;
+        for (const std::string& input : inputs)
+        {
+            std::cout << "Reading " << input << std::endl;
+            InflateStreamReader reader(input);
+            size_t offset = 0;
+
+            std::vector<std::string> inSourceFiles;
+            offset = CppStream::Read(reader, offset, inSourceFiles);
+            std::vector<int64_t> srcFileRemapping(1, 0);
+            for (const std::string& srcfile : inSourceFiles)
+            {
+                auto itSrc = sourceMap.find(srcfile);
+                if (itSrc == sourceMap.end())
+                {
+                    sourceFiles.push_back(srcfile);
+                    itSrc = sourceMap.insert(std::make_pair(srcfile, (int64_t)sourceFiles.size())).first;
+                }
+                srcFileRemapping.push_back(itSrc->second);
+            }
+
+            std::vector<int64_t> tokenRemapping;
+            {
+                std::vector<DbToken> inTokens;
+                offset = CppStream::Read(reader, offset, inTokens);
+                for (const DbToken& token : inTokens)
+                {
+                    auto itTok = tokenMap.find(token.text);
+                    if (itTok == tokenMap.end())
+                    {
+                        itTok = tokenMap.insert(std::make_pair(token.text, (int64_t)tokens.size())).first;
+                        tokens.push_back(DbToken(tokens.size(), token.text));
+                    }
+                    tokenRemapping.push_back(itTok->second);
+                }
+            }
+
+            std::vector<int64_t> typeRemapping;
+            {
+                std::vector<DbType> inTypes;
+                offset = CppStream::Read(reader, offset, inTypes);
+                for (const DbType& otype : inTypes)
+                {
+                    DbType tn = otype;
+                    tn.key = types.size();
+                    if (tn.token >= 0)
+                        tn.token = tokenRemapping[tn.token];
+                    for (int64_t& child : tn.children)
+                        child = typeRemapping[child];
+                    // A hash match only counts if the types agree.
+                    int64_t foundIdx = nullnode;
+                    auto range = tn.hash != 0 ? typeMap.equal_range(tn.hash) :
+                        std::make_pair(typeMap.end(), typeMap.end());
+                    for (auto itFoundType = range.first; itFoundType != range.second && foundIdx == nullnode; ++itFoundType)
+                    {
+                        if (types[itFoundType->second] == tn)
+                            foundIdx = itFoundType->second;
+                    }
+                    if (foundIdx != nullnode)
+                    {
+                        typeRemapping.push_back(foundIdx);
+                        continue;
+                    }
+                    if (tn.hash != 0)
+                        typeMap.insert(std::make_pair(tn.hash, tn.key));
+                    typeRemapping.push_back(tn.key);
+                    types.push_back(tn);
+                }
+            }
+
+            size_t nodeCount;
+            offset = CppStream::Read(reader, offset, nodeCount);
+            std::vector<size_t> nodesTreeHash0(nodeCount);
+            // References to later nodes wait until their target is hashed.
+            std::vector<std::pair<NodeRecord, int64_t>> forwardRefs;
+            for (size_t idx = 0; idx < nodeCount; ++idx)
+            {
+                DbNode dbNode;
+                offset = CppStream::Read(reader, offset, dbNode);
+                dbNode.compilingFile = srcFileRemapping[dbNode.compilingFile];
+                dbNode.sourceFile = dbNode.sourceFile != nullnode ?
+                    srcFileRemapping[dbNode.sourceFile] : nullnode;
+                if (dbNode.token >= 0)
+                    dbNode.token = tokenRemapping[dbNode.token];
+                dbNode.typeIdx = dbNode.typeIdx != nullnode ?
+                    typeRemapping[dbNode.typeIdx] : nullnode;
+
+                NodeRecord record;
+                record.seq = seq++;
+                record.parentHash = 0;
+                record.refHash = 0;
+                if (dbNode.parentNodeIdx != nullnode)
+                {
+                    if (dbNode.parentNodeIdx >= (int64_t)idx)
+                        throw std::runtime_error("node parent out of order in " + input);
+                    record.parentHash = nodesTreeHash0[dbNode.parentNodeIdx];
+                }
+                nodesTreeHash0[idx] = dbNode.GetHashVal(record.parentHash);
+                record.hash = nodesTreeHash0[idx];
+                record.node = dbNode;
+
+                if (dbNode.referencedIdx != nullnode && dbNode.referencedIdx > (int64_t)idx)
+                {
+                    forwardRefs.push_back(std::make_pair(record, dbNode.referencedIdx));
+                    continue;
+                }
+                if (dbNode.referencedIdx != nullnode)
+                    record.refHash = nodesTreeHash0[dbNode.referencedIdx];
+                byHash->Add(record);
+            }
+            for (auto& fwd : forwardRefs)
+            {
+                fwd.first.refHash = fwd.second < (int64_t)nodeCount ? nodesTreeHash0[fwd.second] : 0;
+                if (fwd.second >= (int64_t)nodeCount)
+                    fwd.first.node.referencedIdx = nullnode;
+                byHash->Add(fwd.first);
+            }
+        }
+        byHash->Finish();
+        std::cout << "Sorted " << byHash->Size() << " nodes" << std::endl;
+
+        // Pass 2: keep the first occurrence of each tree hash. Like
+        // RemoveDuplicates, a kept node without a reference takes the first
+        // one a duplicate has.
+        std::unique_ptr<ExternalSorter<NodeRecord, BySeq>> bySeq(
+            new ExternalSorter<NodeRecord, BySeq>(tempDir.string(), "seq", sortBudget));
+        {
+            NodeRecord record;
+            NodeRecord first;
+            bool haveFirst = false;
+            while (byHash->Next(record))
+            {
+                if (haveFirst && record.hash == first.hash)
+                {
+                    if (first.node.referencedIdx == nullnode && record.node.referencedIdx != nullnode)
+                    {
+                        first.node.referencedIdx = record.node.referencedIdx;
+                        first.refHash = record.refHash;
+                    }
+                    continue;
+                }
+                if (haveFirst)
+                    bySeq->Add(first);
+                first = record;
+                haveFirst = true;
+            }
+            if (haveFirst)
+                bySeq->Add(first);
+        }
+        byHash.reset();
+        bySeq->Finish();
+
+        // Pass 3: the order of first occurrence is the output order. Write the
+        // nodes with their links unresolved and collect what to resolve.
+        std::filesystem::path nodesPath = tempDir / "nodes.bin";
+        std::unique_ptr<ExternalSorter<HashIdx, ByHash>> hashToIdx(
+            new ExternalSorter<HashIdx, ByHash>(tempDir.string(), "index", sortBudget));
+        std::unique_ptr<ExternalSorter<LinkRecord, ByLinkHash>> links(
+            new ExternalSorter<LinkRecord, ByLinkHash>(tempDir.string(), "links", sortBudget));
+        size_t nodeCount = 0;
+        {
+            std::ofstream nodesFile(nodesPath, std::ios::out | std::ios::binary);
+            NodeRecord record;
+            while (bySeq->Next(record))
+            {
+                int64_t idx = (int64_t)nodeCount++;
+                record.node.key = idx;
+                nodesFile.write((const char*)&record.node, sizeof(DbNode));
+                hashToIdx->Add(HashIdx{ record.hash, idx });
+                if (record.node.parentNodeIdx != nullnode)
+                    links->Add(LinkRecord{ record.parentHash, idx, ParentField });
+                if (record.node.referencedIdx != nullnode)
+                    links->Add(LinkRecord{ record.refHash, idx, RefField });
+            }
+            if (!nodesFile)
+                throw std::runtime_error("could not write " + nodesPath.string());
+        }
+        bySeq.reset();
+        hashToIdx->Finish();
+        links->Finish();
+
+        // Pass 4: join the link requests with the hash index, then bring the
+        // answers back into node order.
+        ExternalSorter<LinkRecord, ByLinkIdx> resolved(tempDir.string(), "resolved", sortBudget);
+        {
+            HashIdx entry;
+            bool haveEntry = hashToIdx->Next(entry);
+            LinkRecord link;
+            while (links->Next(link))
+            {
+                while (haveEntry && entry.hash < link.hash)
+                    haveEntry = hashToIdx->Next(entry);
+                LinkRecord answer = link;
+                answer.hash = haveEntry && entry.hash == link.hash ? (uint64_t)entry.idx : (uint64_t)nullnode;
+                resolved.Add(answer);
+            }
+        }
+        hashToIdx.reset();
+        links.reset();
+        resolved.Finish();
+
+        // Pass 5: stream the nodes into the output with their links patched.
+        std::cout << "Writing " << output << std::endl;
+        startedOutput = true;
+        DeflateStreamWriter writer(output);
+        CppStream::Write(writer, sourceFiles);
+        CppStream::Write(writer, tokens);
+        CppStream::Write(writer, types);
+        CppStream::Write(writer, nodeCount);
+        {
+            std::ifstream nodesFile(nodesPath, std::ios::in | std::ios::binary);
+            LinkRecord answer;
+            bool haveAnswer = resolved.Next(answer);
+            for (size_t idx = 0; idx < nodeCount; ++idx)
+            {
+                DbNode dbNode;
+                nodesFile.read((char*)&dbNode, sizeof(DbNode));
+                for (; haveAnswer && answer.idx == (int64_t)idx; haveAnswer = resolved.Next(answer))
+                {
+                    if (answer.field == ParentField)
+                        dbNode.parentNodeIdx = (int64_t)answer.hash;
+                    else
+                        dbNode.referencedIdx = (int64_t)answer.hash;
+                }
+                CppStream::Write(writer, dbNode);
+            }
+        }
+        ok = writer.Finish();
+        std::cout << nodeCount << " nodes, " << tokens.size() << " tokens, " << types.size() << " types" << std::endl;
+    }
+    catch (std::exception& ex)
+    {
+        std::cout << "Error: " << ex.what() << std::endl;
+        ok = false;
+    }
+
+    std::error_code ec;
+    std::filesystem::remove_all(tempDir, ec);
+    // Never leave a truncated or unloadable output behind.
+    if (!ok && startedOutput)
+        std::filesystem::remove(output, ec);
+    return ok;
+}
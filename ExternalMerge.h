@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Merges OSY files whose combined nodes do not fit in memory. Source files,
+// tokens and types are kept in memory, as they are small next to the nodes.
+// Nodes are streamed from each input and identified by the same tree hash
+// DbFile::RemoveDuplicates uses, then deduplicated with external sorts that
+// spill runs to a temporary directory. The result keeps the first occurrence
+// of every node in input order, like a serial DbFile::Merge fold.
+class ExternalMerge
+{
+public:
+    struct Options
+    {
+        // Upper bound for sort buffers, in bytes.
+        size_t maxMemory = size_t(1) << 30;
+        // Parent of the directory for sorted runs; defaults to the system one.
+        std::string tempDir;
+    };
+
+    // Parses sizes such as "8G", "512M", "64K" or a plain byte count.
+    // Returns 0 if the text is not a size.
+    static size_t ParseSize(const std::string& text);
+
+    static bool Run(const std::vector<std::string>& inputs, const std::string& output,
+        const Options& options);
+};
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <memory>
+#include <queue>
+#include <filesystem>
+#include <algorithm>
+#include <type_traits>
+#include <stdexcept>
+
+// Sorts more fixed size records than fit in memory. Records are buffered up
+// to a memory budget; a full buffer is sorted and written to a run file in
+// tempDir, and Next then k-way merges the runs. With a single buffer nothing
+// touches the disk. T must be trivially copyable and Less a strict total
+// order, since runs are merged without regard to insertion order.
+template <typename T, typename Less>
+class ExternalSorter
+{
+    static_assert(std::is_trivially_copyable<T>::value);
+
+    struct Run
+    {
+        std::ifstream file;
+        std::vector<T> block;
+        size_t pos = 0;
+        size_t end = 0;
+
+        bool Refill()
+        {
+            file.read((char*)block.data(), block.size() * sizeof(T));
+            end = file.gcount() / sizeof(T);
+            pos = 0;
+            return end > 0;
+        }
+    };
+
+    struct HeapEntry
+    {
+        T record;
+        size_t run;
+    };
+
+    struct HeapGreater
+    {
+        bool operator()(const HeapEntry& a, const HeapEntry& b) const
+        {
+            return Less()(b.record, a.record);
+        }
+    };
+
+    std::string m_tempDir;
+    std::string m_name;
+    size_t m_maxRecords;
+    std::vector<T> m_buffer;
+    std::vector<std::string> m_runFiles;
+    std::vector<std::unique_ptr<Run>> m_runs;
+    std::priority_queue<HeapEntry, std::vector<HeapEntry>, HeapGreater> m_heap;
+    size_t m_memPos = 0;
+    size_t m_count = 0;
+
+    void Spill()
+    {
+        std::sort(m_buffer.begin(), m_buffer.end(), Less());
+        std::string path = (std::filesystem::path(m_tempDir) /
+            (m_name + "." + std::to_string(m_runFiles.size()) + ".run")).string();
+        std::ofstream ofstream(path, std::ios::out | std::ios::binary);
+        ofstream.write((const char*)m_buffer.data(), m_buffer.size() * sizeof(T));
+        if (!ofstream)
+            throw std::runtime_error("could not write " + path);
+        m_runFiles.push_back(path);
+        m_buffer.clear();
+    }
+
+    void Pop(size_t run)
+    {
+        Run& r = *m_runs[run];
+        if (r.pos == r.end && !r.Refill())
+            return;
+        m_heap.push(HeapEntry{ r.block[r.pos++], run });
+    }
+
+public:
+    ExternalSorter(const std::string& tempDir, const std::string& name, size_t memoryBudget) :
+        m_tempDir(tempDir),
+        m_name(name),
+        m_maxRecords(std::max<size_t>(memoryBudget / sizeof(T), 1024))
+    {
+    }
+
+    ~ExternalSorter()
+    {
+        m_runs.clear();
+        for (const std::string& path : m_runFiles)
+        {
+            std::error_code ec;
+            std::filesystem::remove(path, ec);
+        }
+    }
+
+    ExternalSorter(const ExternalSorter&) = delete;
+    ExternalSorter& operator=(const ExternalSorter&) = delete;
+
+    void Add(const T& record)
+    {
+        if (m_buffer.size() >= m_maxRecords)
+            Spill();
+        m_buffer.push_back(record);
+        m_count++;
+    }
+
+    size_t Size() const { return m_count; }
+
+    // Ends the input; records then come out of Next in order.
+    void Finish()
+    {
+        if (m_runFiles.empty())
+        {
+            std::sort(m_buffer.begin(), m_buffer.end(), Less());
+            return;
+        }
+        if (!m_buffer.empty())
+            Spill();
+        std::vector<T>().swap(m_buffer);
+
+        // Every run gets an equal share of the budget as its read block.
+        size_t blockRecords = std::max<size_t>(m_maxRecords / m_runFiles.size(), 256);
+        for (size_t run = 0; run < m_runFiles.size(); ++run)
+        {
+            std::unique_ptr<Run> r(new Run());
+            r->file.open(m_runFiles[run], std::ios::in | std::ios::binary);
+            r->block.resize(blockRecords);
+            r->Refill();
+            m_runs.push_back(std::move(r));
+            Pop(run);
+        }
+    }
+
+    bool Next(T& record)
+    {
+        if (m_runs.empty())
+        {
+            if (m_memPos == m_buffer.size())
+                return false;
+            record = m_buffer[m_memPos++];
+            return true;
+        }
+        if (m_heap.empty())
+            return false;
+        HeapEntry top = m_heap.top();
+        m_heap.pop();
+        record = top.record;
+        Pop(top.run);
+        return true;
+    }
+};
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <mutex>
+
+// Records which translation unit indexed each header during a batch run.
+// The first TU to reach a header claims it and visits its cursors; every
+// other TU skips that header's subtree. Headers whose meaning depends on
+// per-TU macros are only indexed in the configuration of the claiming TU.
+class HeaderRegistry
+{
+    std::mutex m_mtx;
+    std::unordered_map<std::string, std::string> m_owners;
+
+public:
+    // Returns true if owner should index the header, either because it just
+    // claimed it or because it already owned it.
+    bool Claim(const std::string& commitName, const std::string& owner)
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        auto itOwner = m_owners.find(commitName);
+        if (itOwner == m_owners.end())
+        {
+            m_owners.insert(std::make_pair(commitName, owner));
+            return true;
+        }
+        return itOwner->second == owner;
+    }
+
+    size_t Size()
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        return m_owners.size();
+    }
+};
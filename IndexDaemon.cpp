@@ -0,0 +1,549 @@
+#include "Precomp.h"
+#include "CPPSourceFile.h"
+#include "DbMgr.h"
+#include "Node.h"
+#include "IndexSession.h"
+#include "BatchIndexer.h"
+#include "IndexDaemon.h"
+#include <filesystem>
+#include <event2/event.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+namespace
+{
+    // Inclusion paths come back as clang spelled them; relative ones are
+    // relative to the directory the TU was compiled in.
+    std::string NormalizePath(const std::string& path, const std::string& directory)
+    {
+        std::filesystem::path pp(path);
+        if (pp.is_relative() && !directory.empty())
+            pp = std::filesystem::path(directory) / pp;
+        return pp.lexically_normal().string();
+    }
+}
+
+IndexDaemon::IndexDaemon(const Options& options) :
+    m_options(options)
+{
+    if (m_options.jobs == 0)
+        m_options.jobs = 1;
+}
+
+IndexDaemon::~IndexDaemon()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_queueMtx);
+        m_stopping = true;
+    }
+    m_queueCv.notify_all();
+    m_publishCv.notify_all();
+    for (auto& worker : m_workers)
+        worker.join();
+    if (m_publisher.joinable())
+        m_publisher.join();
+    // Snapshots the event loop never got to rename.
+    for (const Snapshot& snapshot : m_snapshots)
+    {
+        std::error_code ec;
+        std::filesystem::remove(snapshot.tmpPath, ec);
+    }
+
+    if (m_inotifyEvent != nullptr)
+        event_free(m_inotifyEvent);
+    if (m_stdinEvent != nullptr)
+        event_free(m_stdinEvent);
+    if (m_wakeEvent != nullptr)
+        event_free(m_wakeEvent);
+    if (m_debounceEvent != nullptr)
+        event_free(m_debounceEvent);
+    if (m_base != nullptr)
+        event_base_free(m_base);
+#ifdef __linux__
+    if (m_inotifyFd >= 0)
+        close(m_inotifyFd);
+    if (m_wakePipe[0] >= 0)
+        close(m_wakePipe[0]);
+    if (m_wakePipe[1] >= 0)
+        close(m_wakePipe[1]);
+#endif
+}
+
+#ifdef __linux__
+
+int IndexDaemon::Run(const std::vector<CompileCommand>& commands)
+{
+    m_commands = commands;
+    m_session.reset(new IndexSession());
+    m_session->SetPruneProfile(m_options.pruneProfile);
+    m_session->SetScopePolicy(m_options.scopePolicy);
+    m_mergeLevels.resize(1);
+    m_mergeLevels[0].resize(m_commands.size());
+    m_tuInclusions.resize(m_commands.size());
+
+    std::cout << "Indexing " << m_commands.size() << " translation units" << std::endl;
+    BatchIndexer::ParallelFor(m_commands.size(), m_options.jobs, [&](size_t idx)
+    {
+        const CompileCommand& cmd = m_commands[idx];
+        std::vector<std::string> none;
+        IndexSession::TUInfo info;
+        try
+        {
+            m_mergeLevels[0][idx] = m_session->CompileToDb(cmd.file, none, none, cmd.arguments,
+                false, std::string(), m_options.rootDir, m_options.loggingFlags, &info);
+        }
+        catch (std::exception& ex)
+        {
+            std::cout << "Error: " << cmd.file << " " << ex.what() << std::endl;
+        }
+        m_tuInclusions[idx] = info.inclusions;
+    });
+
+    m_inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_inotifyFd < 0 || pipe(m_wakePipe) != 0)
+    {
+        std::cerr << "Error: could not set up file watching" << std::endl;
+        return -1;
+    }
+    fcntl(m_wakePipe[0], F_SETFL, O_NONBLOCK);
+    for (size_t idx = 0; idx < m_commands.size(); ++idx)
+        WatchFiles(idx);
+    std::cout << "Watching " << m_watchedDirs.size() << " directories" << std::endl;
+
+    // The first snapshot is built before the event loop exists, so it is
+    // merged and renamed right here.
+    auto publishStart = std::chrono::high_resolution_clock::now();
+    std::set<size_t> allTUs;
+    for (size_t idx = 0; idx < m_commands.size(); ++idx)
+        allTUs.insert(idx);
+    RebuildMergeTree(allTUs);
+    SaveSnapshot(publishStart);
+    RenameSnapshots();
+
+    m_base = event_base_new();
+    m_inotifyEvent = event_new(m_base, m_inotifyFd, EV_READ | EV_PERSIST, &IndexDaemon::OnInotify, this);
+    m_stdinEvent = event_new(m_base, STDIN_FILENO, EV_READ | EV_PERSIST, &IndexDaemon::OnStdin, this);
+    m_wakeEvent = event_new(m_base, m_wakePipe[0], EV_READ | EV_PERSIST, &IndexDaemon::OnWake, this);
+    m_debounceEvent = evtimer_new(m_base, &IndexDaemon::OnDebounce, this);
+    event_add(m_inotifyEvent, nullptr);
+    event_add(m_stdinEvent, nullptr);
+    event_add(m_wakeEvent, nullptr);
+
+    for (size_t t = 0; t < m_options.jobs; ++t)
+        m_workers.push_back(std::thread(&IndexDaemon::Worker, this));
+    m_publisher = std::thread(&IndexDaemon::Publisher, this);
+
+    event_base_dispatch(m_base);
+    return 0;
+}
+
+void IndexDaemon::WatchFiles(size_t tuIdx)
+{
+    const CompileCommand& cmd = m_commands[tuIdx];
+    std::vector<std::string> files = m_tuInclusions[tuIdx];
+    files.push_back(cmd.file);
+    std::string rootDir = m_options.rootDir.empty() ? std::string() :
+        NormalizePath(m_options.rootDir, std::string());
+    for (const std::string& file : files)
+    {
+        std::string path = NormalizePath(file, cmd.directory);
+        // System and third party headers outside the root are not watched.
+        if (!rootDir.empty() && !path.starts_with(rootDir))
+            continue;
+        m_dependents[path].insert(tuIdx);
+
+        std::string dir = std::filesystem::path(path).parent_path().string();
+        if (m_watchedDirs.find(dir) != m_watchedDirs.end())
+            continue;
+        // Directories are watched instead of files, so editors that save by
+        // writing a new file and renaming it over the old one are seen too.
+        int wd = inotify_add_watch(m_inotifyFd, dir.c_str(),
+            IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE);
+        if (wd < 0)
+            continue;
+        m_watchedDirs.insert(dir);
+        m_watchDirs[wd] = dir;
+    }
+}
+
+// Drops the TU from the files it included last time, so a header it no
+// longer includes stops triggering it. Directory watches are left in place.
+void IndexDaemon::ForgetDependents(size_t tuIdx)
+{
+    const CompileCommand& cmd = m_commands[tuIdx];
+    std::vector<std::string> files = m_tuInclusions[tuIdx];
+    files.push_back(cmd.file);
+    for (const std::string& file : files)
+    {
+        auto itDeps = m_dependents.find(NormalizePath(file, cmd.directory));
+        if (itDeps == m_dependents.end())
+            continue;
+        itDeps->second.erase(tuIdx);
+        if (itDeps->second.empty())
+            m_dependents.erase(itDeps);
+    }
+}
+
+void IndexDaemon::OnInotify(int fd, short what, void* arg)
+{
+    IndexDaemon* daemon = (IndexDaemon*)arg;
+    alignas(inotify_event) char buf[16384];
+    for (;;)
+    {
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if (len <= 0)
+            break;
+        for (char* ptr = buf; ptr < buf + len; )
+        {
+            inotify_event* ev = (inotify_event*)ptr;
+            ptr += sizeof(inotify_event) + ev->len;
+            auto itDir = daemon->m_watchDirs.find(ev->wd);
+            if (itDir == daemon->m_watchDirs.end() || ev->len == 0)
+                continue;
+            daemon->FileChanged((std::filesystem::path(itDir->second) / ev->name).string());
+        }
+    }
+}
+
+void IndexDaemon::FileChanged(const std::string& file)
+{
+    auto itDeps = m_dependents.find(file);
+    if (itDeps == m_dependents.end())
+        return;
+    m_changed.insert(itDeps->second.begin(), itDeps->second.end());
+
+    timeval tv;
+    tv.tv_sec = m_options.debounceMs / 1000;
+    tv.tv_usec = (m_options.debounceMs % 1000) * 1000;
+    evtimer_add(m_debounceEvent, &tv);
+}
+
+void IndexDaemon::OnDebounce(int fd, short what, void* arg)
+{
+    IndexDaemon* daemon = (IndexDaemon*)arg;
+    daemon->StartBatch();
+}
+
+void IndexDaemon::StartBatch()
+{
+    for (size_t tuIdx : m_changed)
+    {
+        const CompileCommand& cmd = m_commands[tuIdx];
+        bool priority = m_openFiles.find(NormalizePath(cmd.file, cmd.directory)) != m_openFiles.end();
+        Enqueue(tuIdx, priority);
+    }
+    m_changed.clear();
+}
+
+void IndexDaemon::Enqueue(size_t tuIdx, bool priority)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_queueMtx);
+        if (m_running.find(tuIdx) != m_running.end())
+        {
+            m_held[tuIdx] |= priority;
+            return;
+        }
+        if (!m_queued.insert(tuIdx).second)
+        {
+            if (!priority)
+                return;
+            // Already waiting in the background queue; move it to the front.
+            auto itBg = std::find(m_backgroundQueue.begin(), m_backgroundQueue.end(), tuIdx);
+            if (itBg == m_backgroundQueue.end())
+                return;
+            m_backgroundQueue.erase(itBg);
+        }
+        if (priority)
+            m_priorityQueue.push_back(tuIdx);
+        else
+            m_backgroundQueue.push_back(tuIdx);
+    }
+    m_queueCv.notify_one();
+}
+
+void IndexDaemon::Worker()
+{
+    for (;;)
+    {
+        size_t tuIdx;
+        bool priority;
+        {
+            std::unique_lock<std::mutex> lock(m_queueMtx);
+            m_queueCv.wait(lock, [this]() {
+                return m_stopping || !m_priorityQueue.empty() || !m_backgroundQueue.empty(); });
+            if (m_stopping)
+                return;
+            priority = !m_priorityQueue.empty();
+            std::deque<size_t>& queue = priority ? m_priorityQueue : m_backgroundQueue;
+            tuIdx = queue.front();
+            queue.pop_front();
+            m_queued.erase(tuIdx);
+            m_running.insert(tuIdx);
+            m_inFlight++;
+        }
+
+        const CompileCommand& cmd = m_commands[tuIdx];
+        std::vector<std::string> none;
+        Result result;
+        result.tuIdx = tuIdx;
+        try
+        {
+            // Open files keep a live translation unit so the next save only
+            // reparses the main file against the cached preamble.
+            IndexSession::TUInfo info;
+            if (priority)
+                result.dbFile = m_session->Reindex(cmd.file, none, none, cmd.arguments,
+                    std::vector<IndexSession::UnsavedBuffer>(), m_options.rootDir,
+                    m_options.loggingFlags, &info);
+            else
+                result.dbFile = m_session->CompileToDb(cmd.file, none, none, cmd.arguments,
+                    false, std::string(), m_options.rootDir, m_options.loggingFlags, &info);
+            result.inclusions = info.inclusions;
+        }
+        catch (std::exception& ex)
+        {
+            std::cout << "Error: " << cmd.file << " " << ex.what() << std::endl;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_queueMtx);
+            m_done.push_back(std::move(result));
+            m_running.erase(tuIdx);
+            // A change that came in during the run is indexed again now.
+            auto itHeld = m_held.find(tuIdx);
+            if (itHeld != m_held.end())
+            {
+                m_queued.insert(tuIdx);
+                if (itHeld->second)
+                    m_priorityQueue.push_back(tuIdx);
+                else
+                    m_backgroundQueue.push_back(tuIdx);
+                m_held.erase(itHeld);
+                m_queueCv.notify_one();
+            }
+            m_inFlight--;
+        }
+        char wake = 1;
+        if (write(m_wakePipe[1], &wake, 1) < 0)
+            std::cerr << "Error: could not wake the event loop" << std::endl;
+    }
+}
+
+void IndexDaemon::OnWake(int fd, short what, void* arg)
+{
+    IndexDaemon* daemon = (IndexDaemon*)arg;
+    char buf[256];
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    daemon->DrainResults();
+    daemon->RenameSnapshots();
+}
+
+void IndexDaemon::DrainResults()
+{
+    std::vector<Result> done;
+    {
+        std::lock_guard<std::mutex> lock(m_queueMtx);
+        done.swap(m_done);
+        for (Result& result : done)
+        {
+            // A failed parse keeps the last good result for the TU.
+            if (result.dbFile != nullptr)
+                m_pendingDbs[result.tuIdx] = std::move(result.dbFile);
+        }
+        bool idle = m_inFlight == 0 && m_priorityQueue.empty() && m_backgroundQueue.empty();
+        if (idle && !m_pendingDbs.empty())
+        {
+            m_publishRequested = true;
+            m_publishCv.notify_one();
+        }
+    }
+
+    for (Result& result : done)
+    {
+        if (!result.inclusions.empty())
+        {
+            ForgetDependents(result.tuIdx);
+            m_tuInclusions[result.tuIdx] = result.inclusions;
+            WatchFiles(result.tuIdx);
+        }
+    }
+}
+
+void IndexDaemon::OnStdin(int fd, short what, void* arg)
+{
+    IndexDaemon* daemon = (IndexDaemon*)arg;
+    char buf[4096];
+    ssize_t len = read(fd, buf, sizeof(buf));
+    if (len <= 0)
+    {
+        // The editor went away; keep watching the tree.
+        event_del(daemon->m_stdinEvent);
+        return;
+    }
+    daemon->m_stdinBuffer.append(buf, len);
+    size_t eol;
+    while ((eol = daemon->m_stdinBuffer.find('\n')) != std::string::npos)
+    {
+        std::string line = daemon->m_stdinBuffer.substr(0, eol);
+        daemon->m_stdinBuffer.erase(0, eol + 1);
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        daemon->HandleCommand(line);
+    }
+}
+
+void IndexDaemon::HandleCommand(const std::string& line)
+{
+    size_t space = line.find(' ');
+    std::string cmd = line.substr(0, space);
+    std::string file = space == std::string::npos ? std::string() :
+        NormalizePath(line.substr(space + 1), std::string());
+    if (cmd == "quit")
+        event_base_loopbreak(m_base);
+    else if (cmd == "open" && !file.empty())
+    {
+        m_openFiles.insert(file);
+        auto itDeps = m_dependents.find(file);
+        if (itDeps == m_dependents.end())
+            return;
+        for (size_t tuIdx : itDeps->second)
+        {
+            if (NormalizePath(m_commands[tuIdx].file, m_commands[tuIdx].directory) == file)
+                Enqueue(tuIdx, true);
+        }
+    }
+    else if (cmd == "close" && !file.empty())
+    {
+        m_openFiles.erase(file);
+        auto itDeps = m_dependents.find(file);
+        if (itDeps == m_dependents.end())
+            return;
+        for (size_t tuIdx : itDeps->second)
+        {
+            if (NormalizePath(m_commands[tuIdx].file, m_commands[tuIdx].directory) == file)
+                m_session->ReleaseLive(m_commands[tuIdx].file);
+        }
+    }
+    else if (!cmd.empty())
+        std::cerr << "Error: unknown command " << line << std::endl;
+}
+
+void IndexDaemon::RebuildMergeTree(std::set<size_t> dirty)
+{
+    for (size_t level = 1; m_mergeLevels[level - 1].size() > 1; ++level)
+    {
+        if (m_mergeLevels.size() <= level)
+            m_mergeLevels.emplace_back((m_mergeLevels[level - 1].size() + 1) / 2);
+        const std::vector<std::shared_ptr<DbFile>>& below = m_mergeLevels[level - 1];
+        std::set<size_t> parents;
+        for (size_t idx : dirty)
+            parents.insert(idx / 2);
+        std::vector<size_t> nodes(parents.begin(), parents.end());
+        std::vector<std::shared_ptr<DbFile>>& current = m_mergeLevels[level];
+        BatchIndexer::ParallelFor(nodes.size(), m_options.jobs, [&](size_t idx)
+        {
+            size_t node = nodes[idx];
+            const std::shared_ptr<DbFile>& left = below[node * 2];
+            const std::shared_ptr<DbFile>& right = node * 2 + 1 < below.size() ?
+                below[node * 2 + 1] : nullptr;
+            // A missing side (a TU that never parsed, or the odd node at the
+            // end of a level) shares the other side instead of copying it.
+            if (left == nullptr || right == nullptr)
+            {
+                current[node] = left != nullptr ? left : right;
+                return;
+            }
+            std::shared_ptr<DbFile> merged = std::make_shared<DbFile>();
+            merged->Merge(*left);
+            merged->Merge(*right);
+            current[node] = merged;
+        });
+        dirty.swap(parents);
+    }
+}
+
+void IndexDaemon::SaveSnapshot(std::chrono::high_resolution_clock::time_point start)
+{
+    // Every snapshot gets its own temporary file, so a save never overwrites
+    // one that is still waiting to be renamed.
+    std::string tmpPath = m_options.output + "." + std::to_string(m_snapshotGen++) + ".tmp";
+    const std::shared_ptr<DbFile>& root = m_mergeLevels.back().empty() ?
+        nullptr : m_mergeLevels.back()[0];
+    if (root != nullptr)
+        root->Save(tmpPath);
+    else
+        DbFile().Save(tmpPath);
+
+    std::lock_guard<std::mutex> lock(m_queueMtx);
+    m_snapshots.push_back(Snapshot{ tmpPath, start });
+}
+
+void IndexDaemon::Publisher()
+{
+    for (;;)
+    {
+        std::map<size_t, std::shared_ptr<DbFile>> pending;
+        {
+            std::unique_lock<std::mutex> lock(m_queueMtx);
+            m_publishCv.wait(lock, [this]() { return m_stopping || m_publishRequested; });
+            if (m_stopping)
+                return;
+            m_publishRequested = false;
+            pending.swap(m_pendingDbs);
+        }
+
+        auto start = std::chrono::high_resolution_clock::now();
+        std::set<size_t> dirty;
+        for (auto& tuDb : pending)
+        {
+            m_mergeLevels[0][tuDb.first] = std::move(tuDb.second);
+            dirty.insert(tuDb.first);
+        }
+        RebuildMergeTree(dirty);
+        SaveSnapshot(start);
+
+        char wake = 1;
+        if (write(m_wakePipe[1], &wake, 1) < 0)
+            std::cerr << "Error: could not wake the event loop" << std::endl;
+    }
+}
+
+void IndexDaemon::RenameSnapshots()
+{
+    std::vector<Snapshot> snapshots;
+    {
+        std::lock_guard<std::mutex> lock(m_queueMtx);
+        snapshots.swap(m_snapshots);
+    }
+    // Readers open the snapshot by name, so it is replaced with a rename
+    // rather than rewritten in place.
+    for (const Snapshot& snapshot : snapshots)
+    {
+        std::error_code ec;
+        std::filesystem::rename(snapshot.tmpPath, m_options.output, ec);
+        if (ec)
+        {
+            std::cerr << "Error: could not publish " << m_options.output << " " << ec.message() << std::endl;
+            std::filesystem::remove(snapshot.tmpPath, ec);
+            continue;
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        std::cout << "Published " << m_options.output << " in " <<
+            std::chrono::duration_cast<std::chrono::milliseconds>(end - snapshot.start).count() << " ms" << std::endl;
+    }
+}
+
+#else
+
+int IndexDaemon::Run(const std::vector<CompileCommand>& commands)
+{
+    std::cerr << "Error: --daemon needs inotify and is only available on Linux" << std::endl;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include "CompileDb.h"
+
+class DbFile;
+class IndexSession;
+class PruneProfile;
+class ScopePolicy;
+struct event_base;
+struct event;
+
+// Keeps an index of a compile database up to date. Every translation unit is
+// indexed once at startup; after that the source tree is watched with inotify
+// and only the TUs that include a changed file are re-indexed, on a bounded
+// worker pool. When a batch of changes is done, a publisher thread folds the
+// new per-TU results into the merged index and the snapshot is replaced
+// atomically, so readers never see a partial file.
+//
+// Files opened in an editor are announced on stdin, one command per line:
+//   open <file>    re-index TUs of this file ahead of background work
+//   close <file>   stop prioritizing the file
+//   quit           stop the daemon
+class IndexDaemon
+{
+public:
+    struct Options
+    {
+        std::string output;
+        std::string rootDir;
+        size_t jobs = 1;
+        int loggingFlags = 0;
+        std::shared_ptr<const PruneProfile> pruneProfile;
+        std::shared_ptr<const ScopePolicy> scopePolicy;
+        // Changes that arrive within this window are handled as one batch.
+        int debounceMs = 200;
+    };
+
+    IndexDaemon(const Options& options);
+    ~IndexDaemon();
+
+    // Indexes everything, publishes the first snapshot, then runs the event
+    // loop until quit. Returns non-zero if the daemon could not start.
+    int Run(const std::vector<CompileCommand>& commands);
+
+private:
+    static void OnInotify(int fd, short what, void* arg);
+    static void OnStdin(int fd, short what, void* arg);
+    static void OnWake(int fd, short what, void* arg);
+    static void OnDebounce(int fd, short what, void* arg);
+
+    void HandleCommand(const std::string& line);
+    void WatchFiles(size_t tuIdx);
+    void ForgetDependents(size_t tuIdx);
+    void FileChanged(const std::string& file);
+    void Enqueue(size_t tuIdx, bool priority);
+    void StartBatch();
+    void DrainResults();
+    void RebuildMergeTree(std::set<size_t> dirty);
+    void SaveSnapshot(std::chrono::high_resolution_clock::time_point start);
+    void RenameSnapshots();
+    void Publisher();
+    void Worker();
+
+    Options m_options;
+    std::vector<CompileCommand> m_commands;
+    std::unique_ptr<IndexSession> m_session;
+
+    // Balanced binary merge tree: level 0 holds the result of every TU and
+    // each node above merges its two children, so a changed TU only re-merges
+    // the nodes on its path to the root. Owned by the publisher thread once
+    // the event loop runs.
+    std::vector<std::vector<std::shared_ptr<DbFile>>> m_mergeLevels;
+    std::vector<std::vector<std::string>> m_tuInclusions;
+    // Formatted file path -> TUs that include it (or are it).
+    std::map<std::string, std::set<size_t>> m_dependents;
+    std::set<std::string> m_openFiles;
+    std::set<size_t> m_changed;
+
+    std::mutex m_queueMtx;
+    std::condition_variable m_queueCv;
+    std::deque<size_t> m_priorityQueue;
+    std::deque<size_t> m_backgroundQueue;
+    std::set<size_t> m_queued;
+    // TUs a worker is indexing. A change that arrives meanwhile is held in
+    // m_held (with its priority) until that run is done, so one TU is never
+    // indexed twice at once and results arrive in order.
+    std::set<size_t> m_running;
+    std::map<size_t, bool> m_held;
+    size_t m_inFlight = 0;
+    bool m_stopping = false;
+    struct Result
+    {
+        size_t tuIdx;
+        std::unique_ptr<DbFile> dbFile;
+        std::vector<std::string> inclusions;
+    };
+    std::vector<Result> m_done;
+    std::vector<std::thread> m_workers;
+
+    // Handed from the event loop to the publisher, under m_queueMtx.
+    std::condition_variable m_publishCv;
+    std::map<size_t, std::shared_ptr<DbFile>> m_pendingDbs;
+    bool m_publishRequested = false;
+    // Saved snapshots waiting for the event loop to rename them into place.
+    struct Snapshot
+    {
+        std::string tmpPath;
+        std::chrono::high_resolution_clock::time_point start;
+    };
+    std::vector<Snapshot> m_snapshots;
+    size_t m_snapshotGen = 0;
+    std::thread m_publisher;
+
+    int m_inotifyFd = -1;
+    int m_wakePipe[2] = { -1, -1 };
+    std::map<int, std::string> m_watchDirs;
+    std::set<std::string> m_watchedDirs;
+    std::string m_stdinBuffer;
+
+    event_base* m_base = nullptr;
+    event* m_inotifyEvent = nullptr;
+    event* m_stdinEvent = nullptr;
+    event* m_wakeEvent = nullptr;
+    event* m_debounceEvent = nullptr;
+};
@@ -0,0 +1,90 @@
+#include "Precomp.h"
+#include "IndexHistory.h"
+#include <filesystem>
+#include <sstream>
+
+IndexHistory::IndexHistory(const std::string& path) :
+    m_path(path)
+{
+}
+
+std::string IndexHistory::KeyFor(const CompileCommand& cmd)
+{
+    return cmd.file + "|" + cmd.output;
+}
+
+size_t IndexHistory::EstimateBytes(size_t nodeCount)
+{
+    const size_t bytesPerNode = 1024;
+    return nodeCount * bytesPerNode;
+}
+
+void IndexHistory::Load()
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    std::ifstream ifstream(m_path);
+    std::string line;
+    while (std::getline(ifstream, line))
+    {
+        std::istringstream fields(line);
+        Entry entry;
+        std::string key;
+        if (!(fields >> entry.parseMs >> entry.visitMs >> entry.serializeMs >> entry.nodeCount))
+            continue;
+        fields.get();
+        std::getline(fields, key);
+        if (!key.empty())
+            m_entries[key] = entry;
+    }
+}
+
+bool IndexHistory::Save() const
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    // Written aside and renamed so an interrupted run keeps the old history.
+    std::string tmpPath = m_path + ".tmp";
+    {
+        std::ofstream ofstream(tmpPath);
+        for (const auto& kv : m_entries)
+        {
+            const Entry& entry = kv.second;
+            ofstream << entry.parseMs << '\t' << entry.visitMs << '\t' << entry.serializeMs << '\t' <<
+                entry.nodeCount << '\t' << kv.first << '\n';
+        }
+        if (!ofstream)
+        {
+            std::cout << "Error: could not write " << tmpPath << std::endl;
+            return false;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmpPath, m_path, ec);
+    if (ec)
+    {
+        std::cout << "Error: could not write " << m_path << " " << ec.message() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool IndexHistory::Find(const CompileCommand& cmd, Entry& entry) const
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    auto itEntry = m_entries.find(KeyFor(cmd));
+    if (itEntry == m_entries.end())
+        return false;
+    entry = itEntry->second;
+    return true;
+}
+
+void IndexHistory::Record(const CompileCommand& cmd, const Entry& entry)
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_entries[KeyFor(cmd)] = entry;
+}
+
+size_t IndexHistory::Size() const
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_entries.size();
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <mutex>
+#include "CompileDb.h"
+
+// What each translation unit cost the last time it was indexed, kept in a
+// small text file next to the output so the next run can start the
+// expensive TUs first and keep the huge ones from running all at once.
+// One line per TU: parse, visit and serialize milliseconds, node count and
+// the file|output key, separated by tabs.
+class IndexHistory
+{
+public:
+    struct Entry
+    {
+        double parseMs = 0;
+        double visitMs = 0;
+        double serializeMs = 0;
+        size_t nodeCount = 0;
+
+        double TotalMs() const { return parseMs + visitMs + serializeMs; }
+    };
+
+    IndexHistory(const std::string& path);
+
+    // A missing or unreadable file is an empty history.
+    void Load();
+    bool Save() const;
+
+    bool Find(const CompileCommand& cmd, Entry& entry) const;
+    void Record(const CompileCommand& cmd, const Entry& entry);
+    size_t Size() const;
+
+    // Rough peak memory of indexing a TU that produced nodeCount nodes. It
+    // covers the visitor's node table, the DbFile rows and the clang AST
+    // behind each cursor, and errs on the high side.
+    static size_t EstimateBytes(size_t nodeCount);
+
+private:
+    static std::string KeyFor(const CompileCommand& cmd);
+
+    std::string m_path;
+    mutable std::mutex m_mtx;
+    std::map<std::string, Entry> m_entries;
+};
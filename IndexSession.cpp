@@ -0,0 +1,619 @@
+#include "Precomp.h"
+#include "CPPSourceFile.h"
+#include "DbMgr.h"
+#include "Node.h"
+#include "IndexSession.h"
+#include "HeaderRegistry.h"
+#include "CompileCache.h"
+#include "PruneProfile.h"
+#include "ScopePolicy.h"
+#include <filesystem>
+#define FMT_HEADER_ONLY
+#include "fmt/format.h"
+#include <unordered_map>
+
+void SanityCheckNodes(const std::vector<DbNode>& nodes);
+
+namespace
+{
+    double MsSince(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+}
+
+IndexSession::IndexSession() :
+    m_dbFile(new DbFile()),
+    m_nextErrorKey(1)
+{
+}
+
+IndexSession::~IndexSession()
+{
+    for (auto& kv : m_liveTUs)
+    {
+        if (kv.second->translationUnit != nullptr)
+            clang_disposeTranslationUnit(kv.second->translationUnit);
+        if (kv.second->index != nullptr)
+            clang_disposeIndex(kv.second->index);
+    }
+    for (CXIndex index : m_allIndices)
+        clang_disposeIndex(index);
+}
+
+CXIndex IndexSession::AcquireIndex()
+{
+    std::lock_guard<std::mutex> lock(m_indexMtx);
+    if (m_freeIndices.empty())
+    {
+        CXIndex index = clang_createIndex(0, 0);
+        m_allIndices.push_back(index);
+        return index;
+    }
+    CXIndex index = m_freeIndices.back();
+    m_freeIndices.pop_back();
+    return index;
+}
+
+void IndexSession::ReleaseIndex(CXIndex index)
+{
+    std::lock_guard<std::mutex> lock(m_indexMtx);
+    m_freeIndices.push_back(index);
+}
+
+void IndexSession::SetShareHeaders(bool share)
+{
+    if (!share)
+        m_headers.reset();
+    else if (m_headers == nullptr)
+        m_headers.reset(new HeaderRegistry());
+}
+
+IndexSession::ProjectCache IndexSession::GetPchCache(const std::string& pchfile)
+{
+    std::lock_guard<std::mutex> lock(m_pchMtx);
+    auto itCache = m_pchCaches.find(pchfile);
+    return itCache != m_pchCaches.end() ? itCache->second : ProjectCache();
+}
+
+static void CollectInclusions(CXFile includedFile, CXSourceLocation* inclusionStack,
+    unsigned includeLen, CXClientData clientData)
+{
+    std::set<std::string>* files = (std::set<std::string>*)clientData;
+    std::string commitName = CPPSourceFile::FormatPath(Str(clang_getFileName(includedFile)));
+    if (!commitName.empty())
+        files->insert(commitName);
+}
+
+static void CollectInclusionPaths(CXFile includedFile, CXSourceLocation* inclusionStack,
+    unsigned includeLen, CXClientData clientData)
+{
+    std::set<std::string>* files = (std::set<std::string>*)clientData;
+    std::string fileName = Str(clang_getFileName(includedFile));
+    if (!fileName.empty())
+        files->insert(fileName);
+}
+
+void IndexSession::Merge(const DbFile& tuDb)
+{
+    std::lock_guard<std::mutex> lock(m_dbMtx);
+    m_dbFile->Merge(tuDb);
+}
+
+void IndexSession::Save(const std::string& dbfile)
+{
+    std::lock_guard<std::mutex> lock(m_dbMtx);
+    m_dbFile->Save(dbfile);
+}
+
+std::vector<uint8_t> IndexSession::Compile(const std::string& fname,
+    const std::string &outpath, const std::vector<std::string>& includes,
+    const std::vector<std::string>& defines, const std::vector<std::string> &miscArgs,
+    bool buildPch, const std::string& pchfile, const std::string& rootdir, int loggingFlags,
+    TUInfo* info)
+{
+    std::vector<uint8_t> data;
+    bool useCache = m_cache != nullptr && !outpath.empty() && (!buildPch || !pchfile.empty());
+    std::string cacheKey;
+    if (useCache)
+    {
+        std::vector<std::string> keyArgs = includes;
+        keyArgs.insert(keyArgs.end(), defines.begin(), defines.end());
+        keyArgs.insert(keyArgs.end(), miscArgs.begin(), miscArgs.end());
+        keyArgs.push_back(std::to_string(loggingFlags));
+        if (m_pruneProfile != nullptr)
+            keyArgs.push_back(m_pruneProfile->Signature());
+        if (m_scopePolicy != nullptr)
+            keyArgs.push_back(m_scopePolicy->Signature());
+        if (buildPch)
+            keyArgs.push_back("-emit-pch");
+        // A TU using a PCH is keyed by the contents of the headers the PCH
+        // was built from.
+        std::vector<std::string> pchInputs;
+        if (!buildPch && !pchfile.empty())
+        {
+            ProjectCache pchCache = GetPchCache(pchfile);
+            if (pchCache.inclusionPaths.empty())
+                pchInputs.push_back(pchfile);
+            else
+                pchInputs.assign(pchCache.inclusionPaths.begin(), pchCache.inclusionPaths.end());
+        }
+        cacheKey = m_cache->BaseKey(fname, keyArgs, pchInputs);
+        std::vector<std::string> pchInclusions;
+        if (m_cache->Fetch(cacheKey, outpath, buildPch ? pchfile : std::string(), &pchInclusions))
+        {
+            // A restored PCH is only usable once the session knows which
+            // headers it covers, exactly as after building it.
+            if (buildPch)
+            {
+                ProjectCache pchCache;
+                for (const std::string& inc : pchInclusions)
+                {
+                    std::string commitName = CPPSourceFile::FormatPath(inc);
+                    if (!commitName.empty())
+                        pchCache.pchFiles.insert(commitName);
+                    pchCache.inclusionPaths.insert(inc);
+                }
+                std::lock_guard<std::mutex> lock(m_pchMtx);
+                m_pchCaches[pchfile] = pchCache;
+            }
+            std::cout << "Cached " << fname << std::endl;
+            return data;
+        }
+    }
+
+    TUInfo localInfo;
+    if (info == nullptr && useCache)
+        info = &localInfo;
+    std::unique_ptr<DbFile> dbFile = CompileToDb(fname, includes, defines, miscArgs,
+        buildPch, pchfile, rootdir, loggingFlags, info);
+    if (dbFile == nullptr)
+        return data;
+    auto serializeStart = std::chrono::steady_clock::now();
+    if (!outpath.empty())
+    {
+        // Never write through an existing file: it may be a hard link into
+        // the compile cache.
+        std::error_code ec;
+        std::filesystem::remove(outpath, ec);
+        dbFile->Save(outpath);
+        if (useCache)
+            m_cache->Store(cacheKey, info->inclusions, outpath, buildPch ? pchfile : std::string());
+    }
+    else
+        dbFile->WriteStream(data);
+    if (info != nullptr)
+        info->serializeMs = MsSince(serializeStart);
+    return data;
+}
+
+std::unique_ptr<DbFile> IndexSession::CompileToDb(const std::string& fname,
+    const std::vector<std::string>& includes,
+    const std::vector<std::string>& defines, const std::vector<std::string> &miscArgs,
+    bool buildPch, const std::string& pchfile, const std::string& rootdir, int loggingFlags,
+    TUInfo* info)
+{    
+    ProjectCache projectCache;
+    if (!buildPch && !pchfile.empty())
+        projectCache = GetPchCache(pchfile);
+    std::vector<std::string> clgargs =
+        GenerateCompileArgs(fname, includes, defines,
+            miscArgs,
+            projectCache, buildPch, pchfile, rootdir, loggingFlags);
+  
+    CXTranslationUnit translationUnit;
+    CXIndex index = AcquireIndex();
+    const char** pargs = new const char* [clgargs.size()];
+    for (size_t idx = 0; idx < clgargs.size(); ++idx)
+    {
+        pargs[idx] = clgargs[idx].c_str();
+    }
+
+    unsigned int parseOptions = buildPch ? CXTranslationUnit_ForSerialization : 0;
+    if ((loggingFlags & DeclsOnly) != 0)
+        parseOptions |= CXTranslationUnit_SkipFunctionBodies;
+    auto parseStart = std::chrono::steady_clock::now();
+    CXErrorCode errorCode =
+        clang_parseTranslationUnit2(index, fname.c_str(), pargs, clgargs.size(), nullptr, 0,
+            parseOptions, &translationUnit);
+    delete[] pargs;
+    if (info != nullptr)
+        info->parseMs = MsSince(parseStart);
+
+    if (errorCode != CXErrorCode::CXError_Success)
+    {
+        ReleaseIndex(index);
+        std::cout << "Error: " << fname << " " << errorCode << std::endl;
+        return nullptr;
+    }    
+
+    if (info != nullptr)
+    {
+        std::set<std::string> inclusions;
+        clang_getInclusions(translationUnit, CollectInclusionPaths, &inclusions);
+        info->inclusions.assign(inclusions.begin(), inclusions.end());
+    }
+
+    auto visitStart = std::chrono::steady_clock::now();
+    std::unique_ptr<DbFile> dbFile = VisitTranslationUnit(translationUnit, fname,
+        projectCache, rootdir, loggingFlags, info);
+    if (info != nullptr)
+        info->visitMs = MsSince(visitStart);
+
+    if (buildPch)
+    {
+        std::cout << "Saving " << pchfile << std::endl;
+        CXSaveError saveError = (CXSaveError)clang_saveTranslationUnit(translationUnit, pchfile.c_str(), clang_defaultSaveOptions(translationUnit));
+        if (saveError != CXSaveError::CXSaveError_None)
+        {
+            std::cout << "Save Error: " << saveError << std::endl;
+        }
+        else
+        {
+            ProjectCache pchCache;
+            clang_getInclusions(translationUnit, CollectInclusions, &pchCache.pchFiles);
+            clang_getInclusions(translationUnit, CollectInclusionPaths, &pchCache.inclusionPaths);
+            std::lock_guard<std::mutex> lock(m_pchMtx);
+            m_pchCaches[pchfile] = pchCache;
+        }
+    }
+    clang_disposeTranslationUnit(translationUnit);
+    ReleaseIndex(index);
+    return dbFile;
+}
+
+std::unique_ptr<DbFile> IndexSession::Reindex(const std::string& fname,
+    const std::vector<std::string>& includes,
+    const std::vector<std::string>& defines, const std::vector<std::string>& miscArgs,
+    const std::vector<UnsavedBuffer>& unsaved,
+    const std::string& rootdir, int loggingFlags, TUInfo* info)
+{
+    ProjectCache projectCache;
+    std::vector<std::string> clgargs =
+        GenerateCompileArgs(fname, includes, defines,
+            miscArgs,
+            projectCache, false, std::string(), rootdir, loggingFlags);
+
+    std::shared_ptr<LiveTU> live;
+    {
+        std::lock_guard<std::mutex> lock(m_liveMtx);
+        std::shared_ptr<LiveTU>& slot = m_liveTUs[fname];
+        if (slot == nullptr)
+            slot = std::make_shared<LiveTU>();
+        live = slot;
+    }
+    std::lock_guard<std::mutex> lock(live->mtx);
+
+    std::vector<CXUnsavedFile> unsavedFiles;
+    for (const UnsavedBuffer& buffer : unsaved)
+    {
+        CXUnsavedFile unsavedFile;
+        unsavedFile.Filename = buffer.fileName.c_str();
+        unsavedFile.Contents = buffer.contents.c_str();
+        unsavedFile.Length = buffer.contents.size();
+        unsavedFiles.push_back(unsavedFile);
+    }
+    CXUnsavedFile* pUnsaved = unsavedFiles.empty() ? nullptr : unsavedFiles.data();
+
+    auto parseStart = std::chrono::steady_clock::now();
+
+    if (live->translationUnit != nullptr && live->args != clgargs)
+    {
+        clang_disposeTranslationUnit(live->translationUnit);
+        live->translationUnit = nullptr;
+    }
+
+    if (live->translationUnit != nullptr)
+    {
+        int reparseError = clang_reparseTranslationUnit(live->translationUnit,
+            (unsigned)unsavedFiles.size(), pUnsaved,
+            clang_defaultReparseOptions(live->translationUnit));
+        // A translation unit that failed to reparse can only be disposed.
+        if (reparseError != 0)
+        {
+            clang_disposeTranslationUnit(live->translationUnit);
+            live->translationUnit = nullptr;
+        }
+    }
+
+    if (live->translationUnit == nullptr)
+    {
+        if (live->index == nullptr)
+            live->index = clang_createIndex(0, 0);
+        std::vector<const char*> pargs;
+        for (const std::string& arg : clgargs)
+            pargs.push_back(arg.c_str());
+        live->args = clgargs;
+
+        unsigned int parseOptions =
+            CXTranslationUnit_PrecompiledPreamble | CXTranslationUnit_CreatePreambleOnFirstParse;
+        if ((loggingFlags & DeclsOnly) != 0)
+            parseOptions |= CXTranslationUnit_SkipFunctionBodies;
+        CXErrorCode errorCode =
+            clang_parseTranslationUnit2(live->index, fname.c_str(), pargs.data(), (int)pargs.size(),
+                pUnsaved, (unsigned)unsavedFiles.size(), parseOptions, &live->translationUnit);
+        if (errorCode != CXErrorCode::CXError_Success)
+        {
+            live->translationUnit = nullptr;
+            std::cout << "Error: " << fname << " " << errorCode << std::endl;
+            return nullptr;
+        }
+    }
+
+    if (info != nullptr)
+    {
+        info->parseMs = MsSince(parseStart);
+        // A reparse can add or drop includes, so they are collected every time.
+        std::set<std::string> inclusions;
+        clang_getInclusions(live->translationUnit, CollectInclusionPaths, &inclusions);
+        info->inclusions.assign(inclusions.begin(), inclusions.end());
+    }
+
+    auto visitStart = std::chrono::steady_clock::now();
+    std::unique_ptr<DbFile> dbFile = VisitTranslationUnit(live->translationUnit, fname,
+        projectCache, rootdir, loggingFlags, info);
+    if (info != nullptr)
+        info->visitMs = MsSince(visitStart);
+    return dbFile;
+}
+
+void IndexSession::ReleaseLive(const std::string& fname)
+{
+    std::shared_ptr<LiveTU> live;
+    {
+        std::lock_guard<std::mutex> lock(m_liveMtx);
+        auto itLive = m_liveTUs.find(fname);
+        if (itLive == m_liveTUs.end())
+            return;
+        live = itLive->second;
+        m_liveTUs.erase(itLive);
+    }
+    std::lock_guard<std::mutex> lock(live->mtx);
+    if (live->translationUnit != nullptr)
+        clang_disposeTranslationUnit(live->translationUnit);
+    if (live->index != nullptr)
+        clang_disposeIndex(live->index);
+    live->translationUnit = nullptr;
+    live->index = nullptr;
+}
+
+std::unique_ptr<DbFile> IndexSession::VisitTranslationUnit(CXTranslationUnit translationUnit,
+    const std::string& fname, const ProjectCache& projectCache, const std::string& rootdir,
+    int loggingFlags, TUInfo* info)
+{
+    bool dolog = (loggingFlags & LogNodes) != 0;
+    bool doIsolate = (loggingFlags & IsolateFile) != 0;
+    unsigned int numDiagnostics = clang_getNumDiagnostics(translationUnit);
+    std::vector<ErrorPtr> errors;
+    unsigned int defaultDiag = clang_defaultDiagnosticDisplayOptions();
+    for (unsigned int i = 0; i < numDiagnostics; ++i)
+    {
+        CXDiagnostic diagnostic = clang_getDiagnostic(translationUnit, i);
+        unsigned int category = clang_getDiagnosticCategory(diagnostic);
+        
+        // Ignore warnings
+        if (category >= CXDiagnostic_Error)
+        {
+            ErrorPtr te = new Error();
+            te->Key = NextErrorKey();
+            CXSourceLocation srcLoc = clang_getDiagnosticLocation(diagnostic);
+            CXFile file;
+            unsigned int line;
+            unsigned int column;
+            unsigned int offset;
+            clang_getExpansionLocation(srcLoc, &file, &line, &column, &offset);
+            te->Line = line;
+            te->Column = column;
+            CXString cxfilename = clang_getFileName(file);
+            te->filePath = Str(cxfilename);
+            te->compiledFilePath = fname;
+            te->Category = category;
+
+            CXString cxspell = clang_getDiagnosticSpelling(diagnostic);
+            te->Description = Str(cxspell);
+            if (dolog)
+            {
+                std::cout << te->filePath << "[" << te->Line << "]: " << te->Description << std::endl;
+            }
+            errors.push_back(te);
+            clang_disposeString(cxfilename);
+            clang_disposeString(cxspell);
+        }
+        clang_disposeDiagnostic(diagnostic);
+    }
+    CXCursor startCursor = clang_getTranslationUnitCursor(translationUnit);
+    VisitContext* vc = new VisitContext();
+    vc->pchFiles = projectCache.pchFiles;
+    vc->headerRegistry = m_headers.get();
+    vc->dolog = dolog;
+    vc->logthisfile = false;
+    vc->rootDir = rootdir;
+    vc->compiledFileF = fname;
+    vc->nodes.reserve(50000);
+    vc->clangHashes.reserve(50000);
+    vc->refFixups.reserve(50000);
+    std::unique_ptr<DbFile> dbFile(new DbFile());
+    vc->dbFile = dbFile.get();
+    vc->isolateFile = doIsolate ? fname : std::string();
+    vc->declsOnly = (loggingFlags & DeclsOnly) != 0;
+    vc->pruneProfile = m_pruneProfile.get();
+    vc->scopePolicy = m_scopePolicy.get();
+    vc->compilingFilePtr =
+        vc->dbFile->GetOrInsertFile(CPPSourceFile::FormatPath(fname), vc->compiledFileF);
+    vc->logFilterFile = fname;
+
+    clang_visitChildren(startCursor, Node::ClangVisitor, vc);
+    if (info != nullptr)
+        info->nodeCount = vc->nodes.size();
+
+    vc->compilingFilePtr->CompiledTime = time(nullptr);
+
+    try
+    {
+        vc->dbFile->UpdateRow(vc->compilingFilePtr);
+    }
+    catch (std::system_error& error)
+    {        
+        std::cout << error.what();
+    }
+    
+    std::vector<DbNode>& nodes = vc->nodes;
+
+    /// Resolve references based on clangHash, to the first node of the
+    /// referenced cursor. Cursors the visit made no node of get a reference
+    /// node of their own.
+    std::vector<std::pair<int32_t, int64_t>> nodeHashes(nodes.size());
+    for (size_t idx = 0; idx < nodes.size(); ++idx)
+        nodeHashes[idx] = std::make_pair(vc->clangHashes[idx], (int64_t)idx);
+    std::sort(nodeHashes.begin(), nodeHashes.end());
+    std::vector<int32_t>().swap(vc->clangHashes);
+    auto findNode = [&nodeHashes](int32_t clangHash) -> int64_t
+    {
+        auto itnode = std::lower_bound(nodeHashes.begin(), nodeHashes.end(),
+            std::make_pair(clangHash, (int64_t)nullnode));
+        if (itnode == nodeHashes.end() || itnode->first != clangHash)
+            return nullnode;
+        return itnode->second;
+    };
+    for (const VisitContext::RefFixup& fixup : vc->refFixups)
+    {
+        int64_t target = findNode(clang_hashCursor(fixup.referenced));
+        if (target == nullnode)
+            target = BaseNode::NodeRefFromCursor(fixup.referenced, fixup.nodeIdx, vc);
+        else if (target == fixup.nodeIdx)
+            target = nullnode;
+        nodes[fixup.nodeIdx].referencedIdx = target;
+    }
+    std::vector<VisitContext::RefFixup>().swap(vc->refFixups);
+
+    /// Match function definition nodes to function signatures
+    for (auto& kv : vc->definitionHashes)
+    {
+        int64_t signatureIdx = findNode(kv.first);
+        int64_t definitionIdx = findNode(kv.second);
+        if (signatureIdx != nullnode && definitionIdx != nullnode)
+            nodes[definitionIdx].referencedIdx = signatureIdx;
+    }
+
+    std::vector<TypeNode>& typeNodes = vc->types.Types();
+    for (TypeNode& typeNode : typeNodes)
+        typeNode.tokenIdx = vc->AddToken(typeNode.tokenStr);
+
+    for (auto& node : typeNodes)
+    {
+        for (auto& nc : node.children)
+        {
+            if (nc.idx == nullnode)
+                throw;
+        }
+    }
+
+    for (auto& e : errors)
+    {
+        e->CompiledFile = vc->compilingFilePtr;
+
+        e->File =             
+            vc->dbFile->GetOrInsertFile(CPPSourceFile::FormatPath(e->filePath), std::string());
+    }
+    int64_t tokenOffset = vc->dbFile->AddRows(vc->tokens);
+    for (DbNode& node : nodes)
+        node.token += tokenOffset;
+
+    vc->dbFile->AddRows(typeNodes);
+    vc->dbFile->AddRowsPtr(errors);
+    for (auto& error : errors)
+    {
+        std::string erromsg = fmt::format("{}: [{}, {}] = {}", error->filePath, error->Line, error->Column, error->Description);
+        std::cout << erromsg << std::endl;
+    }
+    SanityCheckNodes(nodes);
+
+    //if (errors.size() == 0)
+    {
+        size_t nodeCount = nodes.size();
+        vc->dbFile->AddNodes(nodes);
+
+        std::cout << "Nodes: " << nodeCount << std::endl;
+        std::cout << "Tokens: " << vc->tokens.size() << std::endl;
+    }
+
+    vc->dbFile->CommitSourceFiles();
+    delete vc;
+    for (auto& error : errors)
+        delete error;
+    return dbFile;
+}
+
+std::vector<std::string> IndexSession::GenerateCompileArgs(const std::string& fname,
+    const std::vector<std::string>& includes,
+    const std::vector<std::string>& defines, const std::vector<std::string>& miscArgs,
+    ProjectCache& pc, bool buildPch, const std::string& pchfile, const std::string& rootdir, int loggingFlags)
+{
+    std::cout << "Compiling " << fname << std::endl;
+
+
+    std::vector<std::string> vcincludes;
+
+    vcincludes.insert(vcincludes.end(), includes.begin(), includes.end());
+
+    // clang-cl only takes cl.exe spellings and the driver's core options.
+    bool clMode = std::find(miscArgs.begin(), miscArgs.end(), "--driver-mode=cl") != miscArgs.end();
+    std::vector<std::string> clgargs = {
+                clMode ? "/Od" : "-O0",
+                "-fsyntax-only"};
+
+    clgargs.insert(clgargs.end(), miscArgs.begin(), miscArgs.end());
+    for (auto define : defines)
+    {
+        clgargs.push_back(std::string("-D") + define);
+    }
+    for (auto incdir : vcincludes)
+    {
+        clgargs.push_back(std::string("-I") + incdir);
+    }
+
+    if (!pchfile.empty() && !buildPch)
+    {
+        if (clMode)
+        {
+            clgargs.push_back("-Xclang");
+            clgargs.push_back("-include-pch");
+            clgargs.push_back("-Xclang");
+            clgargs.push_back(pchfile);
+        }
+        else
+        {
+            clgargs.push_back("-include-pch");
+            clgargs.push_back(pchfile);
+        }
+    }
+
+    for (const std::string& arg : clgargs)
+    {
+        std::cout << " " << arg;
+    }
+    std::cout << std::endl;
+
+    return clgargs;
+}
+
+
+void SanityCheckNodes(const std::vector<DbNode>& nodes)
+{
+    size_t idx = 0;
+    for (auto &node: nodes)
+    { 
+        if (node.key != idx)
+            dbgbreak();
+        if (node.parentNodeIdx != nullnode &&
+            node.parentNodeIdx >= nodes.size())
+            dbgbreak();
+        if (node.parentNodeIdx != nullnode &&
+            node.parentNodeIdx == node.key)
+            dbgbreak();
+        if (node.referencedIdx != nullnode &&
+            node.referencedIdx >= nodes.size())
+            dbgbreak();
+        idx++;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include "clang-c/BuildSystem.h"
+#include "clang-c/Index.h"
+
+class Node;
+class DbFile;
+class HeaderRegistry;
+class CompileCache;
+class VisitContext;
+class PruneProfile;
+class ScopePolicy;
+
+// An independent indexing context. A session owns the libclang indices it
+// parses with, its own key counters and a session wide DbFile, so any number
+// of sessions can live in one process and each can be driven from several
+// threads at once.
+class IndexSession
+{
+public:
+    struct ProjectCache
+    {
+        std::set<std::string> pchFiles;
+        // The same files as pchFiles, with their original spelling.
+        std::set<std::string> inclusionPaths;
+    };
+
+    // Bits of the loggingFlags argument taken by the compile entry points.
+    enum IndexFlags
+    {
+        LogNodes = 1,
+        // Only keep nodes from the file being compiled.
+        IsolateFile = 2,
+        // Parse without function bodies and keep no statement or
+        // expression nodes, for when only the API surface matters.
+        DeclsOnly = 4,
+    };
+
+    // Side information about a translation unit that is not part of its DbFile.
+    struct TUInfo
+    {
+        // Every file the TU included, directly or transitively.
+        std::vector<std::string> inclusions;
+        // Wall time of each stage in milliseconds. serializeMs is only set
+        // by Compile.
+        double parseMs = 0;
+        double visitMs = 0;
+        double serializeMs = 0;
+        // Nodes the visitor produced, the most the TU held at once.
+        size_t nodeCount = 0;
+    };
+
+    // An in-memory editor buffer that overrides the file on disk.
+    struct UnsavedBuffer
+    {
+        std::string fileName;
+        std::string contents;
+    };
+
+    IndexSession();
+    ~IndexSession();
+
+    IndexSession(const IndexSession&) = delete;
+    IndexSession& operator=(const IndexSession&) = delete;
+
+    // Parses and visits one translation unit and returns its DbFile.
+    // Returns nullptr if libclang could not parse the file.
+    std::unique_ptr<DbFile> CompileToDb(const std::string& fname,
+        const std::vector<std::string>& includes,
+        const std::vector<std::string>& defines,
+        const std::vector<std::string>& miscArgs,
+        bool buildPch, const std::string& usePch, const std::string& rootdir, int loggingFlags,
+        TUInfo* info = nullptr);
+
+    // Same contract as Compiler::Compile: writes outpath, or returns the
+    // serialized stream when outpath is empty.
+    std::vector<uint8_t> Compile(const std::string& fname,
+        const std::string& outpath, const std::vector<std::string>& includes,
+        const std::vector<std::string>& defines,
+        const std::vector<std::string>& miscArgs,
+        bool buildPch, const std::string& usePch, const std::string& rootdir, int loggingFlags,
+        TUInfo* info = nullptr);
+
+    // Indexes fname against in-memory editor buffers. The translation unit
+    // stays alive between calls: the first call parses with a precompiled
+    // preamble and later calls with the same arguments only reparse, so the
+    // unchanged include preamble is not parsed again.
+    std::unique_ptr<DbFile> Reindex(const std::string& fname,
+        const std::vector<std::string>& includes,
+        const std::vector<std::string>& defines,
+        const std::vector<std::string>& miscArgs,
+        const std::vector<UnsavedBuffer>& unsaved,
+        const std::string& rootdir, int loggingFlags, TUInfo* info = nullptr);
+
+    // Disposes of the live translation unit kept for fname by Reindex.
+    void ReleaseLive(const std::string& fname);
+
+    // Folds a translation unit into the session wide DbFile.
+    void Merge(const DbFile& tuDb);
+    void Save(const std::string& dbfile);
+
+    int64_t NextErrorKey() { return m_nextErrorKey++; }
+
+    // When enabled, each header is visited only by the first translation unit
+    // of this session that reaches it; later TUs skip its cursors entirely.
+    void SetShareHeaders(bool share);
+
+    // Consult and fill a compile cache when Compile writes to a file. The
+    // cache is not owned by the session.
+    void SetCompileCache(CompileCache* cache) { m_cache = cache; }
+
+    // Cursor kinds to leave out of every translation unit's nodes.
+    void SetPruneProfile(std::shared_ptr<const PruneProfile> profile) { m_pruneProfile = profile; }
+
+    // Which files outside the compiled one are indexed, and how deeply.
+    void SetScopePolicy(std::shared_ptr<const ScopePolicy> policy) { m_scopePolicy = policy; }
+
+    // Headers baked into a precompiled header built by this session. TUs
+    // that use the PCH skip cursors from these files.
+    ProjectCache GetPchCache(const std::string& pchfile);
+
+private:
+    CXIndex AcquireIndex();
+    void ReleaseIndex(CXIndex index);
+
+    std::unique_ptr<DbFile> VisitTranslationUnit(CXTranslationUnit translationUnit,
+        const std::string& fname, const ProjectCache& projectCache, const std::string& rootdir,
+        int loggingFlags, TUInfo* info);
+
+    std::vector<std::string> GenerateCompileArgs(const std::string& fname,
+        const std::vector<std::string>& includes,
+        const std::vector<std::string>& defines, const std::vector<std::string>& miscArgs,
+        ProjectCache& pc, bool buildPch, const std::string& usePch,
+        const std::string& rootdir, int loggingFlags);
+
+    std::mutex m_indexMtx;
+    std::vector<CXIndex> m_freeIndices;
+    std::vector<CXIndex> m_allIndices;
+
+    struct LiveTU
+    {
+        std::mutex mtx;
+        CXIndex index = nullptr;
+        CXTranslationUnit translationUnit = nullptr;
+        std::vector<std::string> args;
+    };
+    std::mutex m_liveMtx;
+    std::map<std::string, std::shared_ptr<LiveTU>> m_liveTUs;
+
+    std::mutex m_dbMtx;
+    std::unique_ptr<DbFile> m_dbFile;
+
+    std::unique_ptr<HeaderRegistry> m_headers;
+    CompileCache* m_cache = nullptr;
+    std::shared_ptr<const PruneProfile> m_pruneProfile;
+    std::shared_ptr<const ScopePolicy> m_scopePolicy;
+
+    std::mutex m_pchMtx;
+    std::map<std::string, ProjectCache> m_pchCaches;
+
+    std::atomic<int64_t> m_nextErrorKey;
+};
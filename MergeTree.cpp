@@ -0,0 +1,190 @@
+#include "Precomp.h"
+#include "CPPSourceFile.h"
+#include "DbMgr.h"
+#include "Node.h"
+#include "BatchIndexer.h"
+#include "ShardPrefetcher.h"
+#include "MergeTree.h"
+#define FMT_HEADER_ONLY
+#include "fmt/format.h"
+#include <filesystem>
+#include <random>
+
+std::vector<std::string> MergeTree::ExpandInputs(const std::vector<std::string>& inputs)
+{
+    std::vector<std::string> files;
+    for (const std::string& input : inputs)
+    {
+        if (!std::filesystem::is_directory(input))
+        {
+            files.push_back(input);
+            continue;
+        }
+        std::vector<std::string> dirFiles;
+        for (const auto& entry : std::filesystem::directory_iterator(input))
+        {
+            if (entry.is_regular_file() && entry.path().extension() == ".osy")
+                dirFiles.push_back(entry.path().string());
+        }
+        std::sort(dirFiles.begin(), dirFiles.end());
+        files.insert(files.end(), dirFiles.begin(), dirFiles.end());
+    }
+    return files;
+}
+
+std::unique_ptr<DbFile> MergeTree::Reduce(const std::vector<std::string>& files, size_t jobs,
+    size_t prefetch)
+{
+    if (files.empty())
+        return nullptr;
+    jobs = std::max<size_t>(jobs, 1);
+    // Every thread reduces one aligned, power of two sized run of leaves, so
+    // the runs are exactly the subtrees the balanced tree would have.
+    size_t chunk = 1;
+    while (chunk * jobs < files.size())
+        chunk *= 2;
+    size_t chunks = (files.size() + chunk - 1) / chunk;
+    std::vector<std::unique_ptr<DbFile>> results(chunks);
+
+    std::atomic<bool> failed(false);
+    BatchIndexer::ParallelFor(chunks, jobs, [&](size_t c)
+    {
+        size_t first = c * chunk;
+        size_t last = std::min(first + chunk, files.size());
+        try
+        {
+            std::vector<std::string> chunkFiles(files.begin() + first, files.begin() + last);
+            ShardPrefetcher prefetcher(chunkFiles, std::max<size_t>(prefetch, 1), 1);
+            // Depth first: a stack of partial results of decreasing height.
+            // Two results of the same height are merged as soon as they
+            // exist, so at most log2(chunk) + 1 are alive at once.
+            std::vector<std::pair<size_t, std::unique_ptr<DbFile>>> stack;
+            for (size_t idx = 0; idx < chunkFiles.size(); ++idx)
+            {
+                stack.push_back(std::make_pair(0, prefetcher.Take(idx)));
+                while (stack.size() >= 2 && stack[stack.size() - 2].first == stack.back().first)
+                {
+                    std::unique_ptr<DbFile> right = std::move(stack.back().second);
+                    stack.pop_back();
+                    stack.back().second->Merge(*right);
+                    stack.back().first++;
+                }
+            }
+            // A short last run leaves subtrees of different heights; fold
+            // them right into left, as the breadth-first tree would.
+            while (stack.size() >= 2)
+            {
+                std::unique_ptr<DbFile> right = std::move(stack.back().second);
+                stack.pop_back();
+                stack.back().second->Merge(*right);
+            }
+            results[c] = std::move(stack.back().second);
+        }
+        catch (std::exception& ex)
+        {
+            std::cout << "Error: " << ex.what() << std::endl;
+            failed = true;
+        }
+    });
+    if (failed)
+        return nullptr;
+
+    // At most jobs results are left; merge them pairwise.
+    for (size_t stride = 1; stride < results.size(); stride *= 2)
+    {
+        size_t pairs = (results.size() + 2 * stride - 1) / (2 * stride);
+        BatchIndexer::ParallelFor(pairs, jobs, [&](size_t p)
+        {
+            size_t left = p * 2 * stride;
+            size_t right = left + stride;
+            if (right >= results.size())
+                return;
+            try
+            {
+                results[left]->Merge(*results[right]);
+                results[right].reset();
+            }
+            catch (std::exception& ex)
+            {
+                std::cout << "Error: " << ex.what() << std::endl;
+                failed = true;
+            }
+        });
+        if (failed)
+            return nullptr;
+    }
+    return std::move(results[0]);
+}
+
+bool MergeTree::Run(const std::vector<std::string>& inputs, const std::string& output,
+    const Options& options)
+{
+    if (inputs.empty())
+        return false;
+    size_t fanin = std::max<size_t>(options.fanin, 2);
+    std::string workDir = options.workDir;
+    if (workDir.empty())
+        workDir = std::filesystem::absolute(output).parent_path().string();
+    std::filesystem::create_directories(workDir);
+    // Several runs can share a work directory, and it may hold shard inputs
+    // too, so intermediate names carry the output stem and a per-run token.
+    std::string runTag = fmt::format("{}.{:08x}", std::filesystem::path(output).stem().string(),
+        (uint32_t)std::random_device{}());
+
+    std::vector<std::string> current = inputs;
+    std::vector<std::string> intermediates;
+    bool ok = true;
+    for (size_t round = 0; ok; ++round)
+    {
+        size_t groups = (current.size() + fanin - 1) / fanin;
+        std::vector<std::string> next(groups);
+        for (size_t g = 0; g < groups; ++g)
+        {
+            next[g] = groups == 1 ? output :
+                (std::filesystem::path(workDir) / fmt::format("{}.merge.r{}.{}.osy", runTag, round, g)).string();
+        }
+        std::cout << "Merge round " << round << ": " << current.size() << " files into " << groups << std::endl;
+
+        std::atomic<bool> failed(false);
+        BatchIndexer::ParallelFor(groups, options.jobs, [&](size_t g)
+        {
+            size_t first = g * fanin;
+            size_t last = std::min(first + fanin, current.size());
+            try
+            {
+                std::vector<std::string> groupFiles(current.begin() + first, current.begin() + last);
+                ShardPrefetcher prefetcher(groupFiles, std::max<size_t>(options.prefetch, 1),
+                    std::max<size_t>(options.prefetch, 1));
+                std::unique_ptr<DbFile> dbFile = prefetcher.Take(0);
+                for (size_t idx = 1; idx < groupFiles.size(); ++idx)
+                    dbFile->Merge(*prefetcher.Take(idx));
+                dbFile->Save(next[g]);
+            }
+            catch (std::exception& ex)
+            {
+                std::cout << "Error: merging into " << next[g] << " " << ex.what() << std::endl;
+                failed = true;
+            }
+        });
+        ok = !failed;
+
+        // Intermediates of the previous round are consumed; inputs are left alone.
+        for (const std::string& file : intermediates)
+            std::filesystem::remove(file);
+        intermediates = next;
+        current = next;
+        if (groups == 1)
+            break;
+    }
+    // A failed round leaves its partial intermediates behind.
+    if (!ok)
+    {
+        for (const std::string& file : intermediates)
+        {
+            std::error_code ec;
+            if (file != output)
+                std::filesystem::remove(file, ec);
+        }
+    }
+    return ok;
+}
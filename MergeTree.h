@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+
+class DbFile;
+
+// Merges many OSY files in rounds. Each round splits the current files into
+// groups of at most fanin and merges every group into one intermediate file
+// with an independent DbFile::Merge chain, so N inputs take log_fanin(N)
+// rounds and the groups of a round can run in parallel. Intermediates are
+// written next to the output, which may live on a shared filesystem.
+class MergeTree
+{
+public:
+    struct Options
+    {
+        size_t fanin = 8;
+        size_t jobs = 1;
+        // Files each merge chain loads ahead on background threads.
+        size_t prefetch = 2;
+        // Directory for intermediate files; defaults to the output's directory.
+        std::string workDir;
+    };
+
+    // Replaces every directory argument by the .osy files it contains, in a
+    // stable order.
+    static std::vector<std::string> ExpandInputs(const std::vector<std::string>& inputs);
+
+    // Merges files in memory as a balanced binary tree, the right subtree
+    // into the left one, so every node is merged about log2(N) times instead
+    // of once per remaining input, and files keep the order a serial fold
+    // gives them. Each of up to jobs threads builds one aligned subtree depth
+    // first, merging equal-height partial results as soon as both exist, so
+    // only O(jobs * log N) merged files are alive at once. Each thread loads
+    // up to prefetch inputs ahead of its merges.
+    static std::unique_ptr<DbFile> Reduce(const std::vector<std::string>& files, size_t jobs,
+        size_t prefetch);
+
+    // Returns false if an input could not be read or the output not written.
+    static bool Run(const std::vector<std::string>& inputs, const std::string& output,
+        const Options& options);
+};
@@ -2,6 +2,9 @@
 #include "CPPSourceFile.h"
 #include "DbMgr.h"
 #include "Node.h"
+#include "HeaderRegistry.h"
+#include "PruneProfile.h"
+#include "ScopePolicy.h"
 
 
 BaseNode::BaseNode(int64_t key) :
@@ -98,27 +101,19 @@ static inline void trim(std::string& s) {
 int64_t BaseNode::NodeFromCursor(CXCursor cursor,
     int64_t parentNode, VisitContextPtr vc)
 {
-    int64_t nodeIdx = vc->allocNodes.size();
-    vc->allocNodes.push_back(Node(nodeIdx));
-    Node& node = vc->allocNodes.back();
-    node.Key = nodeIdx;
-    node.CompilingFile = vc->compilingFilePtr;
-    node.Kind = clang_getCursorKind(cursor);
-    if (node.Kind == CXCursorKind::CXCursor_FirstInvalid ||
-        node.Kind == CXCursorKind::CXCursor_NoDeclFound)
+    CXCursorKind kind = clang_getCursorKind(cursor);
+    if (kind == CXCursorKind::CXCursor_FirstInvalid ||
+        kind == CXCursorKind::CXCursor_NoDeclFound)
         return nullnode;
-    node.clangHash = clang_hashCursor(cursor);
-    node.isref = false;
+    int64_t nodeIdx = vc->nodes.size();
+    int32_t clangHash = clang_hashCursor(cursor);
+    vc->clangHashes.push_back(clangHash);
 
     CXSourceRange range = clang_getCursorExtent(cursor);
     CXSourceLocation srcLoc = clang_getCursorLocation(cursor);
     CXSourceLocation srcEndLoc = clang_getRangeEnd(range);
-    unsigned int defline = 0;
-    unsigned int defcolumn = 0;
-    unsigned int defoffset = 0;
-    CXFile ifile;
 
-    if (node.Kind == CXCursorKind::CXCursor_CXXMethod &&
+    if (kind == CXCursorKind::CXCursor_CXXMethod &&
         clang_isCursorDefinition(cursor) == 0)
     {
         CXCursor defcursor = clang_getCursorDefinition(cursor);
@@ -126,15 +121,10 @@ int64_t BaseNode::NodeFromCursor(CXCursor cursor,
         if (defCursorKind != CXCursor_FirstInvalid)
         {
             int32_t defhash = clang_hashCursor(defcursor);
-            vc->definitionHashes.insert(std::make_pair(node.clangHash, defhash));
+            vc->definitionHashes.insert(std::make_pair(clangHash, defhash));
         }
     }
 
-    node.Linkage = clang_getCursorLinkage(cursor);
-    node.AcessSpecifier = clang_getCXXAccessSpecifier(cursor);
-    node.StorageClass = clang_Cursor_getStorageClass(cursor);
-    node.nTemplateArgs = clang_Cursor_getNumTemplateArguments(cursor);
-
     CXFile file;
     unsigned int line;
     unsigned int column;
@@ -148,146 +138,205 @@ int64_t BaseNode::NodeFromCursor(CXCursor cursor,
     std::string tokenStr = Str(clang_getCursorSpelling(cursor));
     trim(tokenStr);
 
-    node.pTypePtr = TypeFromCursor(cursor, vc);
-    //node.ty
-    node.isAbstract = clang_CXXRecord_isAbstract(cursor) != 0;
-    node.isDeleted = clang_CXXMethod_isDeleted(cursor) != 0;
-    node.tmpTokenString = tokenStr;
-    node.ParentNodeIdx = parentNode;
-    node.Line = line;
-    node.StartOffset = offset;
-    std::string fileName = Str(clang_getFileName(file));
-    std::string commitName = CPPSourceFile::FormatPath(fileName);
-    node.SourceFile = commitName.empty() ?
-        vc->curSourceFile :
-        vc->dbFile->GetOrInsertFile(commitName, fileName);
-    node.EndOffset = endOffset;
+    DbNode node;
+    node.key = nodeIdx;
+    node.compilingFile = vc->compilingFilePtr->Key;
+    node.parentNodeIdx = parentNode;
+    node.referencedIdx = nullnode;
+    node.kind = kind;
+    node.flags = DbNode::MakeFlags(clang_getCXXAccessSpecifier(cursor),
+        clang_CXXRecord_isAbstract(cursor) != 0,
+        clang_Cursor_getStorageClass(cursor),
+        clang_CXXMethod_isDeleted(cursor) != 0);
+    node.typeIdx = TypeFromCursor(cursor, vc);
+    node.token = vc->AddToken(tokenStr);
+    node.line = line;
+    // Only reference nodes record a column.
+    node.column = 0;
+    node.startOffset = offset;
+    node.endOffset = endOffset;
+    CPPSourceFilePtr sourceFile = vc->ResolveFile(file).sourceFile;
+    if (sourceFile == nullptr)
+        sourceFile = vc->curSourceFile;
+    node.sourceFile = sourceFile != nullptr ? sourceFile->Key : nullnode;
+    vc->nodes.push_back(node);
     return nodeIdx;
 }
 
 int64_t BaseNode::NodeRefFromCursor(CXCursor cursor, int64_t parentIdx, VisitContextPtr vc)
 {
     CXCursorKind cursorKind = clang_getCursorKind(cursor);
-    if (cursorKind == CXCursorKind::CXCursor_FirstInvalid)
-        return nullnode;
-    int64_t nodeIdx = vc->allocNodes.size();
-    vc->allocNodes.push_back(Node(nodeIdx));
-    Node& node = vc->allocNodes.back();
-    node.Key = nodeIdx;
-    node.Kind = cursorKind;
-    node.CompilingFile = vc->compilingFilePtr;
-    node.clangHash = clang_hashCursor(cursor);
-    node.isref = true;
+    int64_t nodeIdx = vc->nodes.size();
     CXSourceLocation loc = clang_getCursorLocation(cursor);
     CXFile outfile;
     unsigned int outline, outcol, outoffset;
     clang_getExpansionLocation(loc, &outfile, &outline, &outcol, &outoffset);
-    std::string fileName = Str(clang_getFileName(outfile));
-    std::string commitName = CPPSourceFile::FormatPath(fileName);
-    node.SourceFile = commitName.empty() ?
-        vc->curSourceFile :
-        vc->dbFile->GetOrInsertFile(commitName, fileName);
-    node.Line = outline;
-    node.Column = outcol;
-    node.ParentNodeIdx = parentIdx;
-    node.StartOffset = outoffset;
+
+    DbNode node;
+    node.key = nodeIdx;
+    node.compilingFile = vc->compilingFilePtr->Key;
+    node.parentNodeIdx = parentIdx;
+    node.referencedIdx = nullnode;
+    node.kind = cursorKind;
+    node.flags = 0;
+    node.typeIdx = nullnode;
+    node.token = vc->AddToken(std::string());
+    node.line = outline;
+    node.column = outcol;
+    node.startOffset = outoffset;
+    node.endOffset = 0;
+    CPPSourceFilePtr sourceFile = vc->ResolveFile(outfile).sourceFile;
+    // Cursors without a file, like builtins, are placed with their user.
+    node.sourceFile = sourceFile != nullptr ? sourceFile->Key : vc->nodes[parentIdx].sourceFile;
+    vc->nodes.push_back(node);
     return nodeIdx;
 }
 
-TypeNode* BaseNode::TypeFromCursor(CXCursor cursor, VisitContextPtr vc)
+int64_t BaseNode::TypeFromCursor(CXCursor cursor, VisitContextPtr vc)
 {
     CXType cxtype = clang_getCursorType(cursor);
-
-    TypeNode* tn = TypeFromCxType(cursor, cxtype, vc);
-    tn->CalcHash();
-    return tn;
+    return TypeFromCxType(cursor, cxtype, vc);
 }
 
-TypeNode* BaseNode::TypeFromCxType(CXCursor cursor, CXType cxtype, VisitContextPtr vc)
+int64_t BaseNode::TypeFromCxType(CXCursor cursor, CXType cxtype, VisitContextPtr vc)
 {
-    TypeNode* tn = new TypeNode();
-    tn->TypeKind = cxtype.kind;
-    tn->tokenStr = Str(clang_getTypeSpelling(cxtype));
-    tn->isConst = clang_isConstQualifiedType(cxtype);
-    trim(tn->tokenStr);
+    if (cxtype.kind == CXType_Invalid)
+        return nullnode;
+    int64_t typeIdx;
+    if (vc->types.FindCxType(cxtype, typeIdx))
+        return typeIdx;
+
+    TypeNode tn;
+    tn.TypeKind = cxtype.kind;
+    tn.tokenStr = Str(clang_getTypeSpelling(cxtype));
+    tn.isConst = clang_isConstQualifiedType(cxtype);
+    trim(tn.tokenStr);
 
+    typeIdx = nullnode;
     if (cxtype.kind == CXType_Pointer)
     {
-        cxtype = clang_getPointeeType(cxtype);
-        tn->children.push_back(TypeNode::Child(TypeFromCxType(cursor, cxtype, vc)));
+        CXType childType = clang_getPointeeType(cxtype);
+        tn.children.push_back(TypeNode::Child(TypeFromCxType(cursor, childType, vc)));
     }
     else if (cxtype.kind == CXType_LValueReference)
     {
-        cxtype = clang_getNonReferenceType(cxtype);
-        tn->children.push_back(TypeNode::Child(TypeFromCxType(cursor, cxtype, vc)));
+        CXType childType = clang_getNonReferenceType(cxtype);
+        tn.children.push_back(TypeNode::Child(TypeFromCxType(cursor, childType, vc)));
     }
     else if (cxtype.kind == CXType_Elaborated)
     {
-        cxtype = clang_Type_getNamedType(cxtype);
-        tn->children.push_back(TypeNode::Child(TypeFromCxType(cursor, cxtype, vc)));
+        CXType childType = clang_Type_getNamedType(cxtype);
+        tn.children.push_back(TypeNode::Child(TypeFromCxType(cursor, childType, vc)));
     }
     else if (cxtype.kind == CXType_Typedef)
     {
         CXCursor c = clang_getTypeDeclaration(cxtype);
-        cxtype = clang_getTypedefDeclUnderlyingType(c);
-        tn->children.push_back(TypeNode::Child(TypeFromCxType(cursor, cxtype, vc)));
+        CXType childType = clang_getTypedefDeclUnderlyingType(c);
+        tn.children.push_back(TypeNode::Child(TypeFromCxType(cursor, childType, vc)));
     }
     else if (cxtype.kind == CXType_ConstantArray ||
         cxtype.kind == CXType_IncompleteArray ||
         cxtype.kind == CXType_VariableArray)
     {
-        cxtype = clang_getElementType(cxtype);
-        tn->children.push_back(TypeNode::Child(TypeFromCxType(cursor, cxtype, vc)));
+        CXType childType = clang_getElementType(cxtype);
+        tn.children.push_back(TypeNode::Child(TypeFromCxType(cursor, childType, vc)));
     }
     else if (cxtype.kind == CXType_FunctionProto)
     {
-        cxtype = clang_getResultType(cxtype);
-        tn->children.push_back(TypeNode::Child(TypeFromCxType(cursor, cxtype, vc)));
+        CXType childType = clang_getResultType(cxtype);
+        tn.children.push_back(TypeNode::Child(TypeFromCxType(cursor, childType, vc)));
     }
     else if (cxtype.kind == CXType_Unexposed)
     {
-        TypeNode* tnret = ParseTemplateType(tn->tokenStr);
-        if (tnret != nullptr)
-            return tnret;
+        typeIdx = TemplateFromArguments(cursor, cxtype, tn.tokenStr, vc);
+        if (typeIdx == nullnode)
+            typeIdx = ParseTemplateType(tn.tokenStr, vc);
     }
 
-    constexpr int csize = sizeof("const ") - 1;
-    if (tn->isConst && tn->tokenStr.starts_with("const "))
+    if (typeIdx == nullnode)
     {
-        tn->tokenStr = tn->tokenStr.substr(csize);
+        constexpr int csize = sizeof("const ") - 1;
+        if (tn.isConst && tn.tokenStr.starts_with("const "))
+        {
+            tn.tokenStr = tn.tokenStr.substr(csize);
+        }
+        typeIdx = vc->types.Intern(tn);
     }
-    return tn;
+    vc->types.AddCxType(cxtype, typeIdx);
+    return typeIdx;
 }
 
-TypeNode* BaseNode::ParseTemplateType(const std::string& templateType)
+int64_t BaseNode::TemplateFromArguments(CXCursor cursor, CXType cxtype, const std::string& templateType, VisitContextPtr vc)
 {
+    int nargs = clang_Type_getNumTemplateArguments(cxtype);
     size_t startPos = templateType.find('<');
-    if (startPos == std::string::npos)
-        return nullptr;
-    TypeNode* tn = new TypeNode();
-    tn->TypeKind = CXType_Unexposed;
-    tn->tokenStr = templateType;
+    if (nargs <= 0 || startPos == std::string::npos)
+        return nullnode;
+    std::vector<CXType> argTypes(nargs);
+    for (int arg = 0; arg < nargs; ++arg)
+    {
+        // Values and packs have no type; only the spelling has them.
+        argTypes[arg] = clang_Type_getTemplateArgumentAsType(cxtype, arg);
+        if (argTypes[arg].kind == CXType_Invalid)
+            return nullnode;
+    }
 
+    TypeNode tn;
+    tn.TypeKind = CXType_Unexposed;
+    tn.tokenStr = templateType;
     {
-        TypeNode* tntemplate = new TypeNode();
-        tntemplate->TypeKind = CXType_TemplateType;
-        tntemplate->tokenStr = templateType.substr(0, startPos);
-        tn->children.push_back(tntemplate);
+        TypeNode tntemplate;
+        tntemplate.TypeKind = CXType_TemplateType;
+        tntemplate.tokenStr = templateType.substr(0, startPos);
+        tn.children.push_back(TypeNode::Child(vc->types.Intern(tntemplate)));
     }
-    BaseNode::ParseTemplateParmsRec(templateType, startPos+1, tn->children);
-    return tn;
+    for (CXType argType : argTypes)
+        tn.children.push_back(TypeNode::Child(TypeFromCxType(cursor, argType, vc)));
+    return vc->types.Intern(tn);
 }
 
-size_t BaseNode::ParseTemplateParmsRec(const std::string& templateType, size_t startOffset, std::vector<TypeNode::Child>& outchildren)
+int64_t BaseNode::ParseTemplateType(const std::string& templateType, VisitContextPtr vc)
+{
+    int64_t typeIdx;
+    if (vc->types.FindTemplate(templateType, typeIdx))
+        return typeIdx;
+    typeIdx = nullnode;
+    size_t startPos = templateType.find('<');
+    if (startPos != std::string::npos)
+    {
+        TypeNode tn;
+        tn.TypeKind = CXType_Unexposed;
+        tn.tokenStr = templateType;
+
+        {
+            TypeNode tntemplate;
+            tntemplate.TypeKind = CXType_TemplateType;
+            tntemplate.tokenStr = templateType.substr(0, startPos);
+            tn.children.push_back(TypeNode::Child(vc->types.Intern(tntemplate)));
+        }
+        BaseNode::ParseTemplateParmsRec(templateType, startPos+1, &tn.children, vc);
+        typeIdx = vc->types.Intern(tn);
+    }
+    vc->types.AddTemplate(templateType, typeIdx);
+    return typeIdx;
+}
+
+size_t BaseNode::ParseTemplateParmsRec(const std::string& templateType, size_t startOffset,
+    std::vector<TypeNode::Child>* outchildren, VisitContextPtr vc)
 {
     static char srchChars[] = { '<', '>', ',' };
     constexpr int nchars = sizeof(srchChars) / sizeof(srchChars[0]);
     int curPos = startOffset;
 
-    TypeNode* tn = new TypeNode();
-    tn->TypeKind = CXType_TemplateParam;
-
-    std::vector<TypeNode*> typenodes;
+    auto addParam = [&](size_t endPos)
+    {
+        if (outchildren == nullptr)
+            return;
+        TypeNode tn;
+        tn.TypeKind = CXType_TemplateParam;
+        tn.tokenStr = templateType.substr(startOffset, endPos - startOffset);
+        outchildren->push_back(TypeNode::Child(vc->types.Intern(tn)));
+    };
     while (curPos < templateType.size())
     {
         curPos = templateType.find_first_of(srchChars, curPos, nchars);
@@ -295,23 +344,18 @@ size_t BaseNode::ParseTemplateParmsRec(const std::string& templateType, size_t s
             break;
         else if (templateType[curPos] == '<')
         {
-            std::vector<TypeNode::Child> children;
-            curPos = ParseTemplateParmsRec(templateType, curPos + 1, children);
+            curPos = ParseTemplateParmsRec(templateType, curPos + 1, nullptr, vc);
         }
         else if (templateType[curPos] == '>')
         {
-            tn->tokenStr = templateType.substr(startOffset, curPos - startOffset);
-            outchildren.push_back(tn);
+            addParam(curPos);
             return curPos + 1;
         }
         else if (templateType[curPos] == ',')
         {
-            tn->tokenStr = templateType.substr(startOffset, curPos - startOffset);
-            outchildren.push_back(tn);
+            addParam(curPos);
             curPos++;
             startOffset = curPos;
-            tn = new TypeNode();
-            tn->TypeKind = CXType_TemplateParam;
         }
         else
         {
@@ -324,16 +368,17 @@ size_t BaseNode::ParseTemplateParmsRec(const std::string& templateType, size_t s
 extern std::string cxc[CXCursor_OverloadCandidate + 1];
 extern std::string cxt[CXType_Atomic + 1];
 
-void BaseNode::LogTypeInfo(VisitContextPtr vc, std::ostringstream & strm, TypeNode* ptype)
+void BaseNode::LogTypeInfo(VisitContextPtr vc, std::ostringstream & strm, int64_t typeIdx)
 {
     size_t depth = vc->depth + 1;
-    
+    const TypeNode& type = vc->types.Types()[typeIdx];
+
     strm << std::endl << std::string(depth * 3, ' ') <<
-        " " << cxt[ptype->TypeKind] << ": " << ptype->tokenStr << " C:" << ptype->isConst;
-    for (auto &child : ptype->children)
+        " " << cxt[type.TypeKind] << ": " << type.tokenStr << " C:" << type.isConst;
+    for (auto &child : type.children)
     {
         vc->depth = depth;
-        LogTypeInfo(vc, strm, child.ptr);
+        LogTypeInfo(vc, strm, child.idx);
     }
     vc->depth = depth - 1;
 }
@@ -358,25 +403,46 @@ const char* stgvals[] =
   "Register"
 };
 
-void BaseNode::LogNodeInfo(VisitContextPtr vc, int64_t nodeIdx, std::string tag)
+void BaseNode::LogNodeInfo(VisitContextPtr vc, CXCursor cursor, int64_t nodeIdx, std::string tag)
 {
-    Node &node = vc->allocNodes[nodeIdx];
+    const DbNode &node = vc->nodes[nodeIdx];
+    std::string sourceName;
+    for (const auto& kv : vc->files)
+    {
+        if (kv.second.sourceFile != nullptr && kv.second.sourceFile->Key == node.sourceFile)
+            sourceName = kv.second.sourceFile->Name();
+    }
+    int nTemplateArgs = clang_Cursor_getNumTemplateArguments(cursor);
     size_t depth = vc->depth;
     std::ostringstream strm;
     strm << std::endl << std::string(depth * 3, ' ') <<
-        tag << " " << (node.SourceFile != nullptr ? node.SourceFile->Name() : "") << " [" <<
-        node.Line << ", " << node.Column << "] " << cxc[node.Kind] << " " << node.TypeIdx <<
-        " " << node.tmpTokenString << " " << " " << vals[node.AcessSpecifier] << " " << stgvals[node.StorageClass] <<
-        (node.isDeleted ? " D1" : " D0");
-    if (node.nTemplateArgs > -1)
-        strm << " " << "TA=" << node.nTemplateArgs;
-    if (node.pTypePtr != nullptr)
+        tag << " " << sourceName << " [" <<
+        node.line << ", " << node.column << "] " << cxc[node.kind] << " " << node.typeIdx <<
+        " " << vc->tokens[node.token].Text << " " << " " << vals[node.flags & 0x03] << " " << stgvals[(node.flags >> 3) & 0x07] <<
+        ((node.flags & (1 << 9)) != 0 ? " D1" : " D0");
+    if (nTemplateArgs > -1)
+        strm << " " << "TA=" << nTemplateArgs;
+    if (node.typeIdx != nullnode)
     {
-        LogTypeInfo(vc, strm, node.pTypePtr);
+        LogTypeInfo(vc, strm, node.typeIdx);
     }
     vc->LogTree(strm.str());
 }
 
+void BaseNode::LogRefInfo(VisitContextPtr vc, CXCursor cursor)
+{
+    CXFile file;
+    unsigned int line;
+    unsigned int column;
+    clang_getExpansionLocation(clang_getCursorLocation(cursor), &file, &line, &column, nullptr);
+    CPPSourceFilePtr sourceFile = vc->ResolveFile(file).sourceFile;
+    std::ostringstream strm;
+    strm << std::endl << std::string(vc->depth * 3, ' ') <<
+        "noderef " << (sourceFile != nullptr ? sourceFile->Name() : "") << " [" <<
+        line << ", " << column << "] " << cxc[clang_getCursorKind(cursor)];
+    vc->LogTree(strm.str());
+}
+
 BaseNode::~BaseNode()
 {
 }
@@ -389,8 +455,9 @@ CXChildVisitResult BaseNode::ClangVisitor(CXCursor cursor, CXCursor parent, CXCl
     clang_getExpansionLocation(loc, &file, nullptr, nullptr, nullptr);
     if (vc->prevFile != file)
     {
-        std::string fileName = Str(clang_getFileName(file));
-        std::string commitName = CPPSourceFile::FormatPath(fileName);
+        const VisitContext::FileInfo& fileInfo = vc->ResolveFile(file);
+        const std::string& fileName = fileInfo.fileName;
+        const std::string& commitName = fileInfo.commitName;
 
         //if (vc->dolog)
             //vc->LogTree("\nChange File: " + commitName);
@@ -398,6 +465,25 @@ CXChildVisitResult BaseNode::ClangVisitor(CXCursor cursor, CXCursor parent, CXCl
         if (!commitName.empty())
         {
             vc->skipthisfile = (vc->pchFiles.find(commitName) != vc->pchFiles.end());
+            vc->topLevelOnly = false;
+            if (!vc->skipthisfile && vc->scopePolicy != nullptr &&
+                fileName != vc->compiledFileF)
+            {
+                auto itScope = vc->fileScopes.find(commitName);
+                if (itScope == vc->fileScopes.end())
+                {
+                    ScopePolicy::Scope scope = vc->scopePolicy->Classify(commitName,
+                        clang_Location_isInSystemHeader(loc) != 0);
+                    itScope = vc->fileScopes.insert(std::make_pair(commitName, (int)scope)).first;
+                }
+                vc->skipthisfile = itScope->second == ScopePolicy::Skip;
+                vc->topLevelOnly = itScope->second == ScopePolicy::TopLevel;
+            }
+            if (!vc->skipthisfile && vc->headerRegistry != nullptr &&
+                fileName != vc->compiledFileF)
+            {
+                vc->skipthisfile = !vc->headerRegistry->Claim(commitName, vc->compiledFileF);
+            }
             if (!vc->isolateFile.empty() && vc->isolateFile != fileName)
             {
                 vc->skipthisfile = true;
@@ -420,8 +506,7 @@ CXChildVisitResult BaseNode::ClangVisitor(CXCursor cursor, CXCursor parent, CXCl
 
             vc->visitedFiles.insert(commitName);
 
-            CPPSourceFilePtr sf = vc->dbFile->GetOrInsertFile(commitName, fileName);
-            vc->curSourceFile = sf;
+            vc->curSourceFile = fileInfo.sourceFile;
 
             if (vc->dolog)
             {
@@ -439,37 +524,174 @@ CXChildVisitResult BaseNode::ClangVisitor(CXCursor cursor, CXCursor parent, CXCl
         vc->prevFileCommitName = commitName;
     }
     
-    auto itParNode = vc->nodesMap.find(parent);
-    int64_t parNodeIdx = itParNode != vc->nodesMap.end() ? itParNode->second : nullnode;
+    // Excluded files contribute no nodes at all, just like they contribute no
+    // children.
+    if (vc->skipthisfile)
+        return CXChildVisitResult::CXChildVisit_Continue;
+
+    CXCursorKind cursorKind = clang_getCursorKind(cursor);
+    // Without function bodies there is nothing to index below a
+    // declaration but other declarations.
+    if (vc->declsOnly &&
+        (clang_isStatement(cursorKind) || clang_isExpression(cursorKind)))
+        return CXChildVisitResult::CXChildVisit_Continue;
+
+    bool isContainer = cursorKind == CXCursor_Namespace || cursorKind == CXCursor_LinkageSpec;
+    if (vc->topLevelOnly && !clang_isDeclaration(cursorKind))
+        return CXChildVisitResult::CXChildVisit_Continue;
+
+    if (vc->pruneProfile != nullptr)
+    {
+        PruneProfile::Action action = vc->pruneProfile->ActionFor(cursorKind);
+        if (action == PruneProfile::DropSubtree)
+            return CXChildVisitResult::CXChildVisit_Continue;
+        if (action == PruneProfile::Drop)
+        {
+            // The children find the nearest kept ancestor's node under this
+            // cursor.
+            int64_t ancestorIdx = vc->ParentNode(parent);
+            vc->cursorStack.push_back(VisitContext::OpenCursor{ cursor, ancestorIdx });
+            return CXChildVisitResult::CXChildVisit_Recurse;
+        }
+    }
+
+    int64_t parNodeIdx = vc->ParentNode(parent);
     int64_t nodeIdx = NodeFromCursor(cursor, parNodeIdx, vc);
+    if (nodeIdx == nullnode)
+        return CXChildVisitResult::CXChildVisit_Continue;
     if (vc->logthisfile && !vc->skipthisfile)
-        LogNodeInfo(vc, nodeIdx, "node");
-    vc->allocNodes[nodeIdx].ReferencedIdx = BaseNode::NodeRefFromCursor(clang_getCursorReferenced(cursor), nodeIdx, vc);
-    if (vc->logthisfile && !vc->skipthisfile && vc->allocNodes[nodeIdx].ReferencedIdx != nullnode)
-        LogNodeInfo(vc, vc->allocNodes[nodeIdx].ReferencedIdx, "noderef");
+        LogNodeInfo(vc, cursor, nodeIdx, "node");
+    CXCursor referenced = clang_getCursorReferenced(cursor);
+    if (clang_getCursorKind(referenced) != CXCursorKind::CXCursor_FirstInvalid)
+    {
+        vc->refFixups.push_back(VisitContext::RefFixup{ nodeIdx, referenced });
+        if (vc->logthisfile && !vc->skipthisfile)
+            LogRefInfo(vc, referenced);
+    }
 
-    vc->nodesMap.insert(std::make_pair(cursor, nodeIdx));
-   
-    return vc->skipthisfile ? CXChildVisitResult::CXChildVisit_Continue : CXChildVisitResult::CXChildVisit_Recurse;
+    // Top-level-only files still open namespaces to reach what they declare.
+    if (vc->topLevelOnly && !isContainer)
+        return CXChildVisitResult::CXChildVisit_Continue;
+    vc->cursorStack.push_back(VisitContext::OpenCursor{ cursor, nodeIdx });
+    return CXChildVisitResult::CXChildVisit_Recurse;
 
 }
 
+const VisitContext::FileInfo& VisitContext::ResolveFile(CXFile file)
+{
+    auto itFile = files.find(file);
+    if (itFile != files.end())
+        return itFile->second;
+    FileInfo info;
+    info.fileName = Str(clang_getFileName(file));
+    info.commitName = CPPSourceFile::FormatPath(info.fileName);
+    if (!info.commitName.empty())
+        info.sourceFile = dbFile->GetOrInsertFile(info.commitName, info.fileName);
+    return files.insert(std::make_pair(file, info)).first->second;
+}
+
 std::ostream& operator<<(std::ostream& os, TypeNode const& m) {
     return os << "T: " << m.TypeKind;
 }
 
 
-void TypeNode::CalcHash()
+namespace
+{
+    uint64_t Mix64(uint64_t value)
+    {
+        value += 0x9e3779b97f4a7c15ULL;
+        value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+        return value ^ (value >> 31);
+    }
+
+    // Order dependent, so swapped children give another hash.
+    uint64_t HashCombine(uint64_t seed, uint64_t value)
+    {
+        return Mix64(seed ^ Mix64(value));
+    }
+
+    // FNV-1a rather than std::hash, whose results differ between standard
+    // libraries; databases from different machines are merged by hash.
+    uint64_t SpellingHash(const std::string& spelling)
+    {
+        uint64_t hashCode = 0xcbf29ce484222325ULL;
+        for (char c : spelling)
+            hashCode = (hashCode ^ (unsigned char)c) * 0x100000001b3ULL;
+        return hashCode;
+    }
+
+    uint64_t TypeHash(const TypeNode& tn)
+    {
+        uint64_t hashCode = HashCombine(tn.TypeKind, tn.isConst);
+        return HashCombine(hashCode, SpellingHash(tn.tokenStr));
+    }
+
+    bool SameType(const TypeNode& a, const TypeNode& b)
+    {
+        if (a.TypeKind != b.TypeKind || a.isConst != b.isConst ||
+            a.tokenStr != b.tokenStr || a.children.size() != b.children.size())
+            return false;
+        for (size_t idx = 0; idx < a.children.size(); ++idx)
+        {
+            if (a.children[idx].idx != b.children[idx].idx)
+                return false;
+        }
+        return true;
+    }
+}
+
+int64_t TypeInterner::Intern(TypeNode& tn)
+{
+    static const uint64_t invalidHash = TypeHash(TypeNode());
+    uint64_t hashCode = TypeHash(tn);
+    for (auto& child : tn.children)
+        hashCode = HashCombine(hashCode, child.idx == nullnode ? invalidHash : m_types[child.idx].hash);
+    // Merging treats 0 as "no hash".
+    tn.hash = hashCode != 0 ? hashCode : 1;
+    tn.children.erase(std::remove_if(tn.children.begin(), tn.children.end(),
+        [](const TypeNode::Child& child) { return child.idx == nullnode; }), tn.children.end());
+    return Add(tn);
+}
+
+int64_t TypeInterner::Add(TypeNode& tn)
 {
-    size_t hashCode = 1035752329;
-    hashCode = hashCode * -1521134295 + isConst;
-    hashCode = hashCode * -1521134295 + TypeKind;
-    hashCode = hashCode * -1521134295 + std::hash<std::string>{}(tokenStr);
-    for (auto& c : children)
+    auto range = m_byHash.equal_range(tn.hash);
+    for (auto itType = range.first; itType != range.second; ++itType)
     {
-        c.ptr->CalcHash();
-        hashCode = hashCode * c.ptr->hash;
+        if (SameType(m_types[itType->second], tn))
+            return itType->second;
     }
+    tn.Key = m_types.size();
+    m_byHash.insert(std::make_pair(tn.hash, tn.Key));
+    m_types.push_back(tn);
+    return tn.Key;
+}
 
-    hash = hashCode;
+bool TypeInterner::FindCxType(CXType cxtype, int64_t& typeIdx) const
+{
+    auto itType = m_byCxType.find(cxtype.data[0]);
+    if (itType == m_byCxType.end())
+        return false;
+    typeIdx = itType->second;
+    return true;
+}
+
+void TypeInterner::AddCxType(CXType cxtype, int64_t typeIdx)
+{
+    m_byCxType.insert(std::make_pair(cxtype.data[0], typeIdx));
+}
+
+bool TypeInterner::FindTemplate(const std::string& spelling, int64_t& typeIdx) const
+{
+    auto itType = m_templates.find(spelling);
+    if (itType == m_templates.end())
+        return false;
+    typeIdx = itType->second;
+    return true;
+}
+
+void TypeInterner::AddTemplate(const std::string& spelling, int64_t typeIdx)
+{
+    m_templates.insert(std::make_pair(spelling, typeIdx));
 }
\ No newline at end of file
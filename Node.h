@@ -6,6 +6,7 @@
 #include <fstream>
 #include <atomic>
 #include <map>
+#include <unordered_map>
 #include <set>
 #include <sstream>
 #include "clang-c/BuildSystem.h"
@@ -17,6 +18,9 @@ class CPPSourceFile;
 typedef CPPSourceFile *CPPSourceFilePtr;
 class VisitContext;
 typedef VisitContext *VisitContextPtr;
+class HeaderRegistry;
+class PruneProfile;
+class ScopePolicy;
 
 #define nulltoken (-1)
 struct Token
@@ -34,9 +38,7 @@ class TypeNode
 public:
     struct Child
     {
-        Child(TypeNode* _ptr) : ptr(_ptr), idx(-1){}
-        Child(int64_t _idx) : idx(_idx), ptr(nullptr) {}
-        TypeNode* ptr;
+        Child(int64_t _idx) : idx(_idx) {}
         int64_t idx;
     };
     int64_t Key;
@@ -45,9 +47,9 @@ public:
     int64_t tokenIdx;
     bool isConst;
     std::vector<Child> children;
+    // Structural: kind, constness, spelling and the ordered child hashes.
     size_t hash;
 
-    void CalcHash();
     TypeNode() :
         TypeKind(CXType_Invalid),
         Key(nullnode),
@@ -58,6 +60,42 @@ public:
 
 std::ostream& operator<<(std::ostream& os, TypeNode const& m);
 
+// The types of one translation unit, each stored once. TypeNodes refer to
+// their children by index, and a child always comes before its parent.
+class TypeInterner
+{
+public:
+    // Index of the type equal to tn, which is added if there is none yet.
+    // tn's children are indices into this interner, or nullnode for invalid
+    // types; those are left out but still count towards the hash. The hash
+    // is computed here from the children's, once per type, and equal hashes
+    // are only trusted after comparing the types.
+    int64_t Intern(TypeNode& tn);
+
+    // Types already built, by the CXType they were built from. The first
+    // pointer of a CXType is its clang QualType, qualifiers included.
+    bool FindCxType(CXType cxtype, int64_t& typeIdx) const;
+    void AddCxType(CXType cxtype, int64_t typeIdx);
+    // Results of BaseNode::ParseTemplateType, nullnode for non templates.
+    bool FindTemplate(const std::string& spelling, int64_t& typeIdx) const;
+    void AddTemplate(const std::string& spelling, int64_t typeIdx);
+
+    // Adds every type of other; remap receives the index here of each of
+    // other's types.
+
+    std::vector<TypeNode>& Types() { return m_types; }
+    const std::vector<TypeNode>& Types() const { return m_types; }
+
+private:
+    // Adds tn unless an equal type is there; tn.hash must be set.
+    int64_t Add(TypeNode& tn);
+
+    std::vector<TypeNode> m_types;
+    std::unordered_multimap<size_t, int64_t> m_byHash;
+    std::unordered_map<const void*, int64_t> m_byCxType;
+    std::unordered_map<std::string, int64_t> m_templates;
+};
+
 class BaseNode
 {
 public:
@@ -116,14 +154,22 @@ public:
 
     static int64_t NodeFromCursor(CXCursor cursor, int64_t parentIdx,
         VisitContextPtr vc);
+    // A node for a referenced cursor the translation unit has no node of.
     static int64_t NodeRefFromCursor(CXCursor cursor, int64_t parentIdx, VisitContextPtr vc);
-    static void LogNodeInfo(VisitContextPtr vc, int64_t node, std::string tag);
-    static void LogTypeInfo(VisitContextPtr vc, std::ostringstream& strm, TypeNode *ptype);
+    static void LogNodeInfo(VisitContextPtr vc, CXCursor cursor, int64_t node, std::string tag);
+    static void LogRefInfo(VisitContextPtr vc, CXCursor cursor);
+    static void LogTypeInfo(VisitContextPtr vc, std::ostringstream& strm, int64_t typeIdx);
     static CXChildVisitResult ClangVisitor(CXCursor cursor, CXCursor parent, CXClientData client_data);
-    static TypeNode* TypeFromCxType(CXCursor cursor, CXType cxtype, VisitContextPtr vc);
-    static TypeNode *TypeFromCursor(CXCursor cursor, VisitContextPtr vc);
-    static TypeNode* ParseTemplateType(const std::string& templateType);
-    static size_t ParseTemplateParmsRec(const std::string& templateType, size_t startOffset, std::vector<TypeNode::Child> &outchildren);
+    static int64_t TypeFromCxType(CXCursor cursor, CXType cxtype, VisitContextPtr vc);
+    static int64_t TypeFromCursor(CXCursor cursor, VisitContextPtr vc);
+    // A template specialization: the template's name, then every argument
+    // as its own type. nullnode if an argument is not a type.
+    static int64_t TemplateFromArguments(CXCursor cursor, CXType cxtype, const std::string& templateType, VisitContextPtr vc);
+    // Falls back on the spelling, with one TemplateParam per argument.
+    static int64_t ParseTemplateType(const std::string& templateType, VisitContextPtr vc);
+    // Parameters nested in another template are skipped with a null outchildren.
+    static size_t ParseTemplateParmsRec(const std::string& templateType, size_t startOffset,
+        std::vector<TypeNode::Child>* outchildren, VisitContextPtr vc);
 };
 
 class Node : public BaseNode
@@ -135,7 +181,6 @@ public:
     bool alive;
     Node* pParentPtr;
     Node* pRefPtr;
-    TypeNode* pTypePtr;
 
     Node(int64_t key) : 
         BaseNode(key), 
@@ -143,8 +188,7 @@ public:
         isref(false), 
         alive(true),
         pParentPtr(nullptr), 
-        pRefPtr(nullptr),
-        pTypePtr(nullptr) {}
+        pRefPtr(nullptr) {}
 };
 
 inline std::string Str(CXString str)
@@ -180,11 +224,6 @@ inline bool operator ==(const PrevFile& pv1, const PrevFile& pv2)
 
 typedef PrevFile* PrevFilePtr;
 
-inline bool operator < (const CXCursor &lhs, const CXCursor &rhs)
-{
-    return memcmp(&lhs, &rhs, sizeof(CXCursor)) < 0;
-}
-
 class VisitContext
 {
 public:
@@ -197,9 +236,12 @@ public:
     std::string prevFileCommitName;
     std::set<std::string> newFiles;
     std::set<std::string> pchFiles;
+    HeaderRegistry* headerRegistry = nullptr;
     bool dolog = false;
     bool logthisfile = false;
     bool skipthisfile = false;
+    // The current file only contributes its namespace scope declarations.
+    bool topLevelOnly = false;
     std::string logTree;
     int depth = 0;
     bool parseAllProjFiles = false;
@@ -208,12 +250,76 @@ public:
     std::string rootDir;
     std::string compiledFileF;
     CPPSourceFilePtr compilingFilePtr;
-    std::map<CXCursor, int64_t> nodesMap;
-    std::vector<Node> allocNodes;
+    struct OpenCursor
+    {
+        CXCursor cursor;
+        int64_t nodeIdx;
+    };
+    // Cursors whose children may still be visited, innermost last. Clang
+    // visits depth first, so a callback's parent is always on the stack.
+    std::vector<OpenCursor> cursorStack;
+    // Nodes in the form they are stored in; token indexes tokens and
+    // typeIdx types. referencedIdx is filled in once the visit is done.
+    std::vector<DbNode> nodes;
+    // clang_hashCursor of each node.
+    std::vector<int32_t> clangHashes;
+    struct RefFixup
+    {
+        int64_t nodeIdx;
+        // clang_getCursorReferenced of the node's cursor; it stays valid as
+        // long as the translation unit.
+        CXCursor referenced;
+    };
+    // References to resolve against the nodes of the whole translation unit.
+    std::vector<RefFixup> refFixups;
+    std::vector<Token> tokens;
+    std::unordered_map<std::string, int64_t> tokenMap;
+    // Node::TypeIdx indexes these.
+    TypeInterner types;
     std::map<int32_t, int32_t> definitionHashes;
     std::string isolateFile;
+    bool declsOnly = false;
+    const PruneProfile* pruneProfile = nullptr;
+    const ScopePolicy* scopePolicy = nullptr;
+    // ScopePolicy::Scope of every file seen so far, by commit name.
+    std::unordered_map<std::string, int> fileScopes;
+
+    struct FileInfo
+    {
+        std::string fileName;
+        // fileName after CPPSourceFile::FormatPath; empty for no file.
+        std::string commitName;
+        CPPSourceFilePtr sourceFile = nullptr;
+    };
+    // Every CXFile of the translation unit, resolved once.
+    std::unordered_map<CXFile, FileInfo> files;
+
+    // Names and source file of a CXFile. Formatting the path and finding
+    // the file in dbFile happen on the first call for each file only.
+    const FileInfo& ResolveFile(CXFile file);
     std::string logFilterFile;
 
+    // Node index of parent, closing every cursor opened after it. Cursors
+    // that were never opened, like the translation unit, have no node.
+    int64_t ParentNode(CXCursor parent)
+    {
+        while (!cursorStack.empty() && !clang_equalCursors(cursorStack.back().cursor, parent))
+            cursorStack.pop_back();
+        return cursorStack.empty() ? nullnode : cursorStack.back().nodeIdx;
+    }
+
+    int64_t AddToken(const std::string& text)
+    {
+        auto itToken = tokenMap.find(text);
+        if (itToken == tokenMap.end())
+        {
+            itToken = tokenMap.insert(std::make_pair(text, (int64_t)tokens.size())).first;
+            tokens.push_back(Token(itToken->second));
+            tokens.back().Text = text;
+        }
+        return itToken->second;
+    }
+
     void LogTree(const std::string& log)
     {
         logTree.append(log);
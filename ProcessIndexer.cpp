@@ -0,0 +1,356 @@
+#include "Precomp.h"
+#include "CPPSourceFile.h"
+#include "DbMgr.h"
+#include "Node.h"
+#include "IndexSession.h"
+#include "BatchIndexer.h"
+#include "ProcessIndexer.h"
+#include <filesystem>
+#include <thread>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#endif
+
+ProcessIndexer::ProcessIndexer(const Options& options) :
+    m_options(options)
+{
+    if (m_options.workers == 0)
+        m_options.workers = 1;
+}
+
+#ifndef WIN32
+
+namespace
+{
+    // Single producer, single consumer byte ring in shared memory. head and
+    // tail count bytes ever written and read, so they never wrap.
+    struct RingHeader
+    {
+        std::atomic<uint64_t> head;
+        std::atomic<uint64_t> tail;
+        uint64_t capacity;
+    };
+
+    struct ResultHeader
+    {
+        uint64_t tuIdx;
+        // Payload bytes, or FailedResult if the TU did not parse.
+        uint64_t size;
+    };
+
+    const uint64_t FailedResult = UINT64_MAX;
+    const uint64_t ExitJob = UINT64_MAX;
+
+    class SharedRing
+    {
+        RingHeader* m_hdr;
+        uint8_t* m_data;
+
+    public:
+        SharedRing(void* mem) :
+            m_hdr((RingHeader*)mem),
+            m_data((uint8_t*)mem + sizeof(RingHeader))
+        {
+        }
+
+        static void Init(void* mem, size_t bytes)
+        {
+            RingHeader* hdr = new (mem) RingHeader();
+            hdr->head = 0;
+            hdr->tail = 0;
+            hdr->capacity = bytes - sizeof(RingHeader);
+        }
+
+        // Blocks while the ring is full; pokes notifyFd after every piece so
+        // the coordinator can make room.
+        void Write(const uint8_t* pBytes, size_t len, int notifyFd)
+        {
+            while (len > 0)
+            {
+                uint64_t head = m_hdr->head.load(std::memory_order_relaxed);
+                uint64_t tail = m_hdr->tail.load(std::memory_order_acquire);
+                uint64_t space = m_hdr->capacity - (head - tail);
+                if (space == 0)
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    continue;
+                }
+                size_t pos = head % m_hdr->capacity;
+                size_t cnt = (size_t)std::min<uint64_t>({ space, len, m_hdr->capacity - pos });
+                memcpy(m_data + pos, pBytes, cnt);
+                m_hdr->head.store(head + cnt, std::memory_order_release);
+                pBytes += cnt;
+                len -= cnt;
+                char wake = 1;
+                if (write(notifyFd, &wake, 1) < 0 && errno != EAGAIN)
+                    _exit(1);
+            }
+        }
+
+        // Appends everything currently in the ring to out.
+        void Read(std::vector<uint8_t>& out)
+        {
+            uint64_t tail = m_hdr->tail.load(std::memory_order_relaxed);
+            uint64_t head = m_hdr->head.load(std::memory_order_acquire);
+            while (tail < head)
+            {
+                size_t pos = tail % m_hdr->capacity;
+                size_t cnt = (size_t)std::min<uint64_t>(head - tail, m_hdr->capacity - pos);
+                out.insert(out.end(), m_data + pos, m_data + pos + cnt);
+                tail += cnt;
+            }
+            m_hdr->tail.store(tail, std::memory_order_release);
+        }
+    };
+
+    [[noreturn]] void WorkerMain(int jobFd, int notifyFd, void* shm,
+        const std::vector<CompileCommand>& commands, const ProcessIndexer::Options& options)
+    {
+        SharedRing ring(shm);
+        for (;;)
+        {
+            uint64_t tuIdx;
+            if (read(jobFd, &tuIdx, sizeof(tuIdx)) != sizeof(tuIdx) || tuIdx == ExitJob)
+                _exit(0);
+
+            const CompileCommand& cmd = commands[tuIdx];
+            std::vector<std::string> none;
+            std::vector<uint8_t> data;
+            try
+            {
+                IndexSession session;
+                session.SetPruneProfile(options.pruneProfile);
+                session.SetScopePolicy(options.scopePolicy);
+                data = session.Compile(cmd.file, std::string(), none, none, cmd.arguments,
+                    false, std::string(), options.rootDir, options.loggingFlags);
+            }
+            catch (std::exception& ex)
+            {
+                std::cout << "Error: " << cmd.file << " " << ex.what() << std::endl;
+            }
+            std::cout.flush();
+
+            ResultHeader hdr;
+            hdr.tuIdx = tuIdx;
+            hdr.size = data.empty() ? FailedResult : data.size();
+            ring.Write((const uint8_t*)&hdr, sizeof(hdr), notifyFd);
+            if (!data.empty())
+                ring.Write(data.data(), data.size(), notifyFd);
+        }
+    }
+}
+
+void ProcessIndexer::Spawn(size_t slot, const std::vector<CompileCommand>& commands)
+{
+    Worker& worker = m_workers[slot];
+    if (worker.shm == nullptr)
+    {
+        worker.shm = mmap(nullptr, m_options.ringBytes, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (worker.shm == MAP_FAILED)
+            throw std::runtime_error("could not map the result ring");
+    }
+    SharedRing::Init(worker.shm, m_options.ringBytes);
+    worker.pending.clear();
+    worker.tuIdx = -1;
+
+    int jobPipe[2];
+    int notifyPipe[2];
+    if (pipe(jobPipe) != 0 || pipe(notifyPipe) != 0)
+        throw std::runtime_error("could not create worker pipes");
+
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid < 0)
+        throw std::runtime_error("could not fork a worker");
+    if (pid == 0)
+    {
+        // Only the coordinator may hold the other workers' pipes, or they
+        // would never see end of file when it goes away.
+        for (size_t other = 0; other < m_workers.size(); ++other)
+        {
+            if (other == slot)
+                continue;
+            if (m_workers[other].jobFd >= 0)
+                close(m_workers[other].jobFd);
+            if (m_workers[other].notifyFd >= 0)
+                close(m_workers[other].notifyFd);
+        }
+        close(jobPipe[1]);
+        close(notifyPipe[0]);
+        WorkerMain(jobPipe[0], notifyPipe[1], worker.shm, commands, m_options);
+    }
+
+    close(jobPipe[0]);
+    close(notifyPipe[1]);
+    fcntl(notifyPipe[0], F_SETFL, O_NONBLOCK);
+    worker.pid = pid;
+    worker.jobFd = jobPipe[1];
+    worker.notifyFd = notifyPipe[0];
+}
+
+void ProcessIndexer::Reap(Worker& worker)
+{
+    if (worker.jobFd >= 0)
+        close(worker.jobFd);
+    if (worker.notifyFd >= 0)
+        close(worker.notifyFd);
+    worker.jobFd = -1;
+    worker.notifyFd = -1;
+    worker.pid = -1;
+}
+
+size_t ProcessIndexer::Drain(Worker& worker, const std::vector<CompileCommand>& commands, size_t& failed)
+{
+    char buf[256];
+    while (read(worker.notifyFd, buf, sizeof(buf)) > 0)
+        ;
+    SharedRing(worker.shm).Read(worker.pending);
+
+    size_t completed = 0;
+    size_t offset = 0;
+    while (worker.pending.size() - offset >= sizeof(ResultHeader))
+    {
+        ResultHeader hdr;
+        memcpy(&hdr, worker.pending.data() + offset, sizeof(hdr));
+        size_t payload = hdr.size == FailedResult ? 0 : (size_t)hdr.size;
+        if (worker.pending.size() - offset - sizeof(hdr) < payload)
+            break;
+        const CompileCommand& cmd = commands[hdr.tuIdx];
+        if (hdr.size == FailedResult)
+        {
+            std::cout << "Error: " << cmd.file << " failed to index" << std::endl;
+            failed++;
+        }
+        else
+        {
+            std::vector<uint8_t> data(worker.pending.begin() + offset + sizeof(hdr),
+                worker.pending.begin() + offset + sizeof(hdr) + payload);
+            DbFile::SaveStream(BatchIndexer::OutputPathFor(m_options.outDir, cmd), data);
+        }
+        offset += sizeof(hdr) + payload;
+        if ((int64_t)hdr.tuIdx == worker.tuIdx)
+            worker.tuIdx = -1;
+        completed++;
+    }
+    worker.pending.erase(worker.pending.begin(), worker.pending.begin() + offset);
+    return completed;
+}
+
+size_t ProcessIndexer::Run(const std::vector<CompileCommand>& commands)
+{
+    std::filesystem::create_directories(m_options.outDir);
+    for (const CompileCommand& cmd : commands)
+        std::filesystem::remove(BatchIndexer::OutputPathFor(m_options.outDir, cmd));
+
+    // A worker that dies with its pipe open must not take the coordinator down.
+    signal(SIGPIPE, SIG_IGN);
+    m_workers.resize(std::min(m_options.workers, std::max<size_t>(commands.size(), 1)));
+    for (size_t slot = 0; slot < m_workers.size(); ++slot)
+        Spawn(slot, commands);
+
+    size_t nextTu = 0;
+    size_t completed = 0;
+    size_t failed = 0;
+    while (completed < commands.size())
+    {
+        for (Worker& worker : m_workers)
+        {
+            if (worker.pid < 0 || worker.tuIdx >= 0 || nextTu >= commands.size())
+                continue;
+            uint64_t job = nextTu;
+            if (write(worker.jobFd, &job, sizeof(job)) != sizeof(job))
+                continue;
+            worker.tuIdx = (int64_t)nextTu++;
+            worker.started = std::chrono::steady_clock::now();
+        }
+
+        std::vector<pollfd> fds;
+        for (const Worker& worker : m_workers)
+            fds.push_back(pollfd{ worker.notifyFd, POLLIN, 0 });
+        poll(fds.data(), fds.size(), 100);
+
+        for (size_t slot = 0; slot < m_workers.size(); ++slot)
+        {
+            Worker& worker = m_workers[slot];
+            if (worker.pid < 0)
+                continue;
+            completed += Drain(worker, commands, failed);
+
+            bool restart = false;
+            int status;
+            if (waitpid(worker.pid, &status, WNOHANG) == worker.pid)
+            {
+                // A result written before the crash still counts.
+                completed += Drain(worker, commands, failed);
+                if (worker.tuIdx >= 0)
+                {
+                    std::cout << "Error: worker crashed on " << commands[worker.tuIdx].file << std::endl;
+                    failed++;
+                    completed++;
+                }
+                restart = true;
+            }
+            else if (worker.tuIdx >= 0 &&
+                std::chrono::steady_clock::now() - worker.started > std::chrono::seconds(m_options.timeoutSec))
+            {
+                std::cout << "Error: timed out on " << commands[worker.tuIdx].file << std::endl;
+                kill(worker.pid, SIGKILL);
+                waitpid(worker.pid, &status, 0);
+                failed++;
+                completed++;
+                restart = true;
+            }
+
+            if (restart)
+            {
+                Reap(worker);
+                if (nextTu < commands.size())
+                    Spawn(slot, commands);
+                else
+                {
+                    // Nothing left to hand out; keep the slot idle.
+                    worker.tuIdx = -1;
+                }
+            }
+        }
+
+        // Slots without a process never get work again.
+        bool anyAlive = false;
+        for (const Worker& worker : m_workers)
+            anyAlive |= worker.pid >= 0;
+        if (!anyAlive)
+            break;
+    }
+
+    for (Worker& worker : m_workers)
+    {
+        if (worker.pid >= 0)
+        {
+            uint64_t job = ExitJob;
+            if (write(worker.jobFd, &job, sizeof(job)) != sizeof(job))
+                kill(worker.pid, SIGKILL);
+            int status;
+            waitpid(worker.pid, &status, 0);
+            Reap(worker);
+        }
+        if (worker.shm != nullptr)
+            munmap(worker.shm, m_options.ringBytes);
+        worker.shm = nullptr;
+    }
+    return failed + (commands.size() - completed);
+}
+
+#else
+
+size_t ProcessIndexer::Run(const std::vector<CompileCommand>& commands)
+{
+    std::cerr << "Error: --isolation process needs fork and is not available on this platform" << std::endl;
+    return commands.size();
+}
+
+#endif
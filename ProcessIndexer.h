@@ -0,0 +1,61 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <memory>
+#include "CompileDb.h"
+
+class PruneProfile;
+class ScopePolicy;
+
+// Indexes a compile database on forked worker processes instead of threads,
+// so a translation unit that crashes or hangs libclang only costs that one
+// TU. Each worker runs IndexSession::Compile with an empty outpath and streams
+// the serialized DbFile back through a ring buffer in memory shared with the
+// coordinator. The coordinator writes the .osy files, kills workers that
+// exceed the per-TU timeout and respawns workers that die. POSIX only.
+class ProcessIndexer
+{
+public:
+    struct Options
+    {
+        std::string outDir;
+        std::string rootDir;
+        size_t workers = 1;
+        int loggingFlags = 0;
+        std::shared_ptr<const PruneProfile> pruneProfile;
+        std::shared_ptr<const ScopePolicy> scopePolicy;
+        // A TU that takes longer than this is abandoned and its worker killed.
+        int timeoutSec = 600;
+        // Size of each worker's result ring; results larger than the ring
+        // are streamed through it in pieces.
+        size_t ringBytes = 64 << 20;
+    };
+
+    ProcessIndexer(const Options& options);
+
+    // Returns the number of translation units that failed, crashed or timed out.
+    size_t Run(const std::vector<CompileCommand>& commands);
+
+private:
+    struct Worker
+    {
+        int pid = -1;
+        int jobFd = -1;
+        int notifyFd = -1;
+        void* shm = nullptr;
+        int64_t tuIdx = -1;
+        std::chrono::steady_clock::time_point started;
+        std::vector<uint8_t> pending;
+    };
+
+    void Spawn(size_t slot, const std::vector<CompileCommand>& commands);
+    void Reap(Worker& worker);
+    // Moves finished results out of the worker's ring; returns the number
+    // of TUs that completed.
+    size_t Drain(Worker& worker, const std::vector<CompileCommand>& commands, size_t& failed);
+
+    Options m_options;
+    std::vector<Worker> m_workers;
+};
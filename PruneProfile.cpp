@@ -0,0 +1,161 @@
+#include "Precomp.h"
+#include "PruneProfile.h"
+#include <unordered_map>
+#include <sstream>
+#include <filesystem>
+
+extern std::unordered_map<CXCursorKind, std::string> sCursorKindMap;
+
+namespace
+{
+    const CXCursorKind LiteralKinds[] =
+    {
+        CXCursor_IntegerLiteral,
+        CXCursor_FloatingLiteral,
+        CXCursor_ImaginaryLiteral,
+        CXCursor_StringLiteral,
+        CXCursor_CharacterLiteral,
+        CXCursor_CXXBoolLiteralExpr,
+        CXCursor_CXXNullPtrLiteralExpr,
+    };
+
+    bool FindKind(const std::string& name, CXCursorKind& kind)
+    {
+        static const std::unordered_map<std::string, CXCursorKind> kindsByName = []()
+        {
+            std::unordered_map<std::string, CXCursorKind> byName;
+            for (const auto& kv : sCursorKindMap)
+                byName[kv.second] = kv.first;
+            // The dump names the first kind of each range after the range.
+            byName["UnexposedExpr"] = CXCursor_UnexposedExpr;
+            byName["UnexposedStmt"] = CXCursor_UnexposedStmt;
+            byName["UnexposedAttr"] = CXCursor_UnexposedAttr;
+            byName["ImaginaryLiteral"] = CXCursor_ImaginaryLiteral;
+            return byName;
+        }();
+        std::string plain = name.starts_with("CXCursor_") ? name.substr(sizeof("CXCursor_") - 1) : name;
+        auto itKind = kindsByName.find(plain);
+        if (itKind == kindsByName.end())
+            return false;
+        kind = itKind->second;
+        return true;
+    }
+}
+
+PruneProfile::PruneProfile() :
+    m_actions(CXCursor_OverloadCandidate + 1, Keep)
+{
+}
+
+std::shared_ptr<const PruneProfile> PruneProfile::Create(const std::string& nameOrPath)
+{
+    std::shared_ptr<PruneProfile> profile(new PruneProfile());
+    if (profile->ApplyBuiltin(nameOrPath))
+        return profile;
+    if (!std::filesystem::exists(nameOrPath))
+    {
+        std::cout << "Error: " << nameOrPath << " is neither a profile (full, navigation, api) nor a file" << std::endl;
+        return nullptr;
+    }
+    if (!profile->LoadFile(nameOrPath))
+        return nullptr;
+    return profile;
+}
+
+bool PruneProfile::ApplyBuiltin(const std::string& name)
+{
+    if (name == "full")
+        return true;
+    if (name == "navigation")
+    {
+        // Wrappers that only add depth; their children stay.
+        Set("UnexposedExpr", Drop);
+        Set("ParenExpr", Drop);
+        Set("UnexposedStmt", Drop);
+        Set("NullStmt", Drop);
+        Set("@literals", Drop);
+        return true;
+    }
+    if (name == "api")
+    {
+        Set("@statements", DropSubtree);
+        Set("@expressions", DropSubtree);
+        return true;
+    }
+    return false;
+}
+
+bool PruneProfile::LoadFile(const std::string& path)
+{
+    std::ifstream ifstream(path);
+    std::string line;
+    int lineNo = 0;
+    while (std::getline(ifstream, line))
+    {
+        lineNo++;
+        size_t comment = line.find('#');
+        if (comment != std::string::npos)
+            line.resize(comment);
+        std::istringstream words(line);
+        std::string directive;
+        std::string name;
+        if (!(words >> directive))
+            continue;
+        words >> name;
+
+        bool ok;
+        if (directive == "base")
+            ok = ApplyBuiltin(name);
+        else if (directive == "drop")
+            ok = Set(name, Drop);
+        else if (directive == "drop-subtree")
+            ok = Set(name, DropSubtree);
+        else if (directive == "keep")
+            ok = Set(name, Keep);
+        else
+            ok = false;
+        if (!ok)
+        {
+            std::cout << "Error: " << path << "(" << lineNo << "): cannot apply '" << directive << " " << name << "'" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool PruneProfile::Set(const std::string& name, Action action)
+{
+    if (name == "@expressions" || name == "@statements")
+    {
+        bool expressions = name == "@expressions";
+        for (size_t kind = 0; kind < m_actions.size(); ++kind)
+        {
+            CXCursorKind cursorKind = (CXCursorKind)kind;
+            if (expressions ? clang_isExpression(cursorKind) : clang_isStatement(cursorKind))
+                m_actions[kind] = action;
+        }
+        return true;
+    }
+    if (name == "@literals")
+    {
+        for (CXCursorKind kind : LiteralKinds)
+            m_actions[kind] = action;
+        return true;
+    }
+    CXCursorKind kind;
+    if (!FindKind(name, kind) || (size_t)kind >= m_actions.size())
+        return false;
+    m_actions[kind] = action;
+    return true;
+}
+
+std::string PruneProfile::Signature() const
+{
+    std::string signature;
+    for (size_t kind = 0; kind < m_actions.size(); ++kind)
+    {
+        if (m_actions[kind] != Keep)
+            signature += std::to_string(kind) + (m_actions[kind] == Drop ? "d," : "s,");
+    }
+    return signature;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include "clang-c/Index.h"
+
+// Cursor kinds that ClangVisitor leaves out of the index. A dropped cursor
+// gets no node, and its children hang off the nearest kept ancestor
+// instead; a cursor dropped with its subtree is not descended into at all.
+//
+// Profiles are either built in (full, navigation, api) or read from a file
+// with one directive per line:
+//
+//     # comment
+//     base navigation
+//     drop ParenExpr
+//     drop-subtree @statements
+//     keep CompoundStmt
+//
+// Kinds are spelled as in the OSY dump, with or without the CXCursor_
+// prefix. @expressions, @statements and @literals name groups of kinds.
+// Later lines override earlier ones.
+class PruneProfile
+{
+public:
+    enum Action : uint8_t
+    {
+        Keep,
+        Drop,
+        DropSubtree,
+    };
+
+    // A built-in profile name or the path of a profile file. Prints the
+    // problem and returns nullptr if neither works.
+    static std::shared_ptr<const PruneProfile> Create(const std::string& nameOrPath);
+
+    Action ActionFor(CXCursorKind kind) const
+    {
+        return (size_t)kind < m_actions.size() ? (Action)m_actions[kind] : Keep;
+    }
+
+    // Changes with every kind's action; part of compile cache keys.
+    std::string Signature() const;
+
+private:
+    PruneProfile();
+
+    bool ApplyBuiltin(const std::string& name);
+    bool LoadFile(const std::string& path);
+    // Sets action for a kind name or a @group; false if the name is unknown.
+    bool Set(const std::string& name, Action action);
+
+    std::vector<uint8_t> m_actions;
+};
@@ -0,0 +1,93 @@
+#include "Precomp.h"
+#include "ScopePolicy.h"
+
+namespace
+{
+    std::string NormalizeGlob(const std::string& glob)
+    {
+        std::string normal = glob;
+        for (char& c : normal)
+        {
+            if (c == '\\')
+                c = '/';
+            else
+                c = (char)std::tolower((unsigned char)c);
+        }
+        return normal;
+    }
+}
+
+void ScopePolicy::AddInclude(const std::string& glob)
+{
+    m_includes.push_back(NormalizeGlob(glob));
+}
+
+void ScopePolicy::AddExclude(const std::string& glob)
+{
+    m_excludes.push_back(NormalizeGlob(glob));
+}
+
+bool ScopePolicy::GlobMatch(const char* glob, const char* path)
+{
+    while (*glob != '\0')
+    {
+        if (glob[0] == '*' && glob[1] == '*')
+        {
+            glob += 2;
+            // "**/" also matches no directory at all.
+            if (*glob == '/' && GlobMatch(glob + 1, path))
+                return true;
+            for (const char* rest = path; ; ++rest)
+            {
+                if (GlobMatch(glob, rest))
+                    return true;
+                if (*rest == '\0')
+                    return false;
+            }
+        }
+        if (*glob == '*')
+        {
+            glob++;
+            for (const char* rest = path; ; ++rest)
+            {
+                if (GlobMatch(glob, rest))
+                    return true;
+                if (*rest == '\0' || *rest == '/')
+                    return false;
+            }
+        }
+        if (*path == '\0' || (*glob != '?' && *glob != *path) || (*glob == '?' && *path == '/'))
+            return false;
+        glob++;
+        path++;
+    }
+    return *path == '\0';
+}
+
+ScopePolicy::Scope ScopePolicy::Classify(const std::string& commitName, bool isSystemHeader) const
+{
+    if (!m_includes.empty())
+    {
+        bool included = false;
+        for (const std::string& glob : m_includes)
+            included = included || GlobMatch(glob.c_str(), commitName.c_str());
+        if (!included)
+            return Skip;
+    }
+    for (const std::string& glob : m_excludes)
+    {
+        if (GlobMatch(glob.c_str(), commitName.c_str()))
+            return Skip;
+    }
+    return isSystemHeader ? m_systemHeaders : Full;
+}
+
+std::string ScopePolicy::Signature() const
+{
+    std::string signature = "scope" + std::to_string((int)m_systemHeaders);
+    for (const std::string& glob : m_includes)
+        signature += "|+" + glob;
+    for (const std::string& glob : m_excludes)
+        signature += "|-" + glob;
+    return signature;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+
+// Decides how much of each file ClangVisitor indexes. It is consulted
+// whenever the visitor moves into another file; the file being compiled
+// is always indexed in full.
+//
+// A file is skipped if include globs are given and it matches none of
+// them, or if it matches any exclude glob. Otherwise system headers get the
+// systemHeaders scope and every other file is indexed in full. Globs match
+// the whole path: * and ? stay within one path component, ** crosses
+// components. Paths are compared lowercase with forward slashes, like
+// CPPSourceFile::FormatPath.
+class ScopePolicy
+{
+public:
+    enum Scope
+    {
+        Full,
+        // Only declarations at namespace scope, without their members,
+        // parameters or bodies.
+        TopLevel,
+        Skip,
+    };
+
+    void AddInclude(const std::string& glob);
+    void AddExclude(const std::string& glob);
+    void SetSystemHeaders(Scope scope) { m_systemHeaders = scope; }
+
+    // commitName is a path as returned by CPPSourceFile::FormatPath.
+    Scope Classify(const std::string& commitName, bool isSystemHeader) const;
+
+    // Changes with the rules; part of compile cache keys.
+    std::string Signature() const;
+
+    static bool GlobMatch(const char* glob, const char* path);
+
+private:
+    std::vector<std::string> m_includes;
+    std::vector<std::string> m_excludes;
+    Scope m_systemHeaders = Full;
+};
@@ -0,0 +1,86 @@
+#include "Precomp.h"
+#include "CPPSourceFile.h"
+#include "DbMgr.h"
+#include "Node.h"
+#include "ShardPrefetcher.h"
+
+ShardPrefetcher::ShardPrefetcher(const std::vector<std::string>& files, size_t depth, size_t threads) :
+    m_files(files),
+    m_depth(std::max<size_t>(depth, 1)),
+    m_slots(files.size()),
+    m_errors(files.size()),
+    m_ready(files.size()),
+    m_taken(files.size())
+{
+    threads = std::min(std::max<size_t>(threads, 1), files.size());
+    for (size_t t = 0; t < threads; ++t)
+        m_threads.push_back(std::thread(&ShardPrefetcher::Loader, this));
+}
+
+ShardPrefetcher::~ShardPrefetcher()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_stopping = true;
+    }
+    m_windowCv.notify_all();
+    for (auto& thread : m_threads)
+        thread.join();
+}
+
+void ShardPrefetcher::Loader()
+{
+    for (;;)
+    {
+        size_t idx;
+        {
+            std::unique_lock<std::mutex> lock(m_mtx);
+            m_windowCv.wait(lock, [this]() {
+                return m_stopping || m_nextLoad >= m_files.size() ||
+                    m_nextLoad < m_lowestUntaken + m_depth; });
+            if (m_stopping || m_nextLoad >= m_files.size())
+                return;
+            idx = m_nextLoad++;
+        }
+
+        std::unique_ptr<DbFile> dbFile(new DbFile());
+        std::string error;
+        try
+        {
+            std::cout << "Reading " << m_files[idx] << std::endl;
+            dbFile->Load(m_files[idx]);
+        }
+        catch (std::exception& ex)
+        {
+            error = ex.what();
+            dbFile.reset();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_slots[idx] = std::move(dbFile);
+            m_errors[idx] = error;
+            m_ready[idx] = 1;
+        }
+        m_loadedCv.notify_all();
+    }
+}
+
+std::unique_ptr<DbFile> ShardPrefetcher::Take(size_t idx)
+{
+    std::unique_ptr<DbFile> dbFile;
+    std::string error;
+    {
+        std::unique_lock<std::mutex> lock(m_mtx);
+        m_loadedCv.wait(lock, [&]() { return m_ready[idx] != 0; });
+        dbFile = std::move(m_slots[idx]);
+        error = m_errors[idx];
+        m_taken[idx] = 1;
+        while (m_lowestUntaken < m_files.size() && m_taken[m_lowestUntaken])
+            m_lowestUntaken++;
+    }
+    m_windowCv.notify_all();
+    if (dbFile == nullptr)
+        throw std::runtime_error("could not load " + m_files[idx] + " " + error);
+    return dbFile;
+}
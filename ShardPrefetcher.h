@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+class DbFile;
+
+// Loads OSY files on background threads ahead of the threads that merge
+// them, so file reads, inflate and deserialization overlap DbFile::Merge.
+// Files are loaded in order and never more than depth past the lowest file
+// that has not been taken yet, which bounds the memory held by the queue.
+class ShardPrefetcher
+{
+public:
+    ShardPrefetcher(const std::vector<std::string>& files, size_t depth, size_t threads);
+    ~ShardPrefetcher();
+
+    ShardPrefetcher(const ShardPrefetcher&) = delete;
+    ShardPrefetcher& operator=(const ShardPrefetcher&) = delete;
+
+    // Blocks until file idx is loaded and hands it over. Each file can be
+    // taken once; callers should take files in roughly ascending order.
+    std::unique_ptr<DbFile> Take(size_t idx);
+
+private:
+    void Loader();
+
+    std::vector<std::string> m_files;
+    size_t m_depth;
+
+    std::mutex m_mtx;
+    std::condition_variable m_loadedCv;
+    std::condition_variable m_windowCv;
+    std::vector<std::unique_ptr<DbFile>> m_slots;
+    std::vector<std::string> m_errors;
+    std::vector<uint8_t> m_ready;
+    std::vector<uint8_t> m_taken;
+    size_t m_nextLoad = 0;
+    size_t m_lowestUntaken = 0;
+    bool m_stopping = false;
+    std::vector<std::thread> m_threads;
+};
@@ -14,7 +14,6 @@ class ICppStreamPos
 {
 public:
     virtual size_t GetPos() const = 0;
-    virtual void SetPos(size_t) = 0;
 };
 
 class ICppStreamWriter : public ICppStreamPos
@@ -57,7 +56,7 @@ public:
     {
         return m_offset;
     }
-    virtual void SetPos(size_t offset) override
+    void SetPos(size_t offset)
     {
         m_offset = offset;
     }
@@ -82,7 +81,7 @@ public:
     {
         return m_offset;
     }
-    virtual void SetPos(size_t offset) override
+    void SetPos(size_t offset)
     {
         m_offset = offset;
     }
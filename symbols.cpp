@@ -4,6 +4,17 @@
 #include "Node.h"
 #include "Compiler.h"
 #include "OsyToSqlite.h"
+#include "CompileDb.h"
+#include "BatchIndexer.h"
+#include "IndexSession.h"
+#include "CompileCache.h"
+#include "IndexDaemon.h"
+#include "MergeTree.h"
+#include "ExternalMerge.h"
+#include "ProcessIndexer.h"
+#include "PruneProfile.h"
+#include "ScopePolicy.h"
+#include <thread>
 
 #ifdef WIN32
 #define stat _stat
@@ -32,6 +43,8 @@ void printUsage()
     std::cout << "  symbols [COMMAND] [OPTIONS]\n\n";
     std::cout << "COMMANDS:\n";
     std::cout << "  --compile <file>              Parse C++ source file and generate OSY database\n";
+    std::cout << "  --compile-db <compile_commands.json>  Parse every entry of a compile database, one OSY per TU\n";
+    std::cout << "  --daemon <compile_commands.json>  Watch the sources and keep a merged OSY up to date\n";
     std::cout << "  --dump <file.osy>             Display contents of OSY file for debugging\n";
     std::cout << "  --validate <file.osy>         Validate the structure of an OSY file\n";
     std::cout << "  --merge <files...>            Merge multiple OSY files into one\n";
@@ -40,10 +53,54 @@ void printUsage()
     std::cout << "OPTIONS (for --compile):\n";
     std::cout << "  --output <file>               Specify output OSY file path\n";
     std::cout << "  --include-directory <path>    Add include directory (can be used multiple times)\n";
-    std::cout << "  --define <macro[=value]>      Define preprocessor macro (can be used multiple times)\n\n";
+    std::cout << "  --define <macro[=value]>      Define preprocessor macro (can be used multiple times)\n";
+    std::cout << "  --cache-dir <dir>             Reuse cached OSY output when the file and its includes are unchanged\n";
+    std::cout << "  --prune <profile|file>        Leave cursor kinds out of the index: full, navigation, api or a profile file\n";
+    std::cout << "  --scope-include <glob>        Only index headers matching a glob (can be used multiple times)\n";
+    std::cout << "  --scope-exclude <glob>        Do not index headers matching a glob (can be used multiple times)\n";
+    std::cout << "  --system-headers <mode>       full, top-level (namespace scope declarations only) or skip\n";
+    std::cout << "  --decls-only                  Skip function bodies; index declarations only\n\n";
+    std::cout << "OPTIONS (for --compile-db):\n";
+    std::cout << "  --output <dir>                Directory that receives one OSY file per translation unit\n";
+    std::cout << "  -j, --jobs <n>                Number of worker threads (default: hardware threads)\n";
+    std::cout << "  --workers <n>                 Same as --jobs\n";
+    std::cout << "  --isolation <thread|process>  Index on threads (default) or on forked worker processes\n";
+    std::cout << "  --timeout <seconds>           Per-TU limit for --isolation process (default: 600)\n";
+    std::cout << "  --merged-output <file>        Merge all TUs in process into one OSY file (--output becomes optional)\n";
+    std::cout << "  --shard <i/N>                 Index only shard i of N, balanced by estimated cost\n";
+    std::cout << "  --history <file>              Per-TU timings used to start expensive TUs first (default: <output>/index-history.tsv)\n";
+    std::cout << "  --max-memory <size>           Keep the estimated memory of TUs indexed at once under size (e.g. 16G)\n";
+    std::cout << "  --prune <profile|file>        Leave cursor kinds out of the index: full, navigation, api or a profile file\n";
+    std::cout << "  --scope-include <glob>        Only index headers matching a glob (can be used multiple times)\n";
+    std::cout << "  --scope-exclude <glob>        Do not index headers matching a glob (can be used multiple times)\n";
+    std::cout << "  --system-headers <mode>       full, top-level (namespace scope declarations only) or skip\n";
+    std::cout << "  --decls-only                  Skip function bodies; index declarations only\n";
+    std::cout << "  --no-shared-headers           Index every header in every TU instead of only the first TU to reach it\n";
+    std::cout << "  --no-auto-pch                 Do not build shared PCHs for TUs with common leading #includes\n";
+    std::cout << "  --cache-dir <dir>             Reuse cached OSY output for unchanged TUs (implies --no-shared-headers)\n\n";
+    std::cout << "OPTIONS (for --merge):\n";
+    std::cout << "  --output <file>               Merged OSY file; directory inputs contribute all their .osy files\n";
+    std::cout << "  --merge-tree [fanin=K]        Merge in rounds of independent K-way merges (default K=8)\n";
+    std::cout << "  --max-memory <size>           Merge out of core, keeping sort buffers under size (e.g. 8G)\n";
+    std::cout << "  --temp-dir <dir>              Directory for sorted runs of --max-memory (default: system temp)\n";
+    std::cout << "  --work-dir <dir>              Directory for intermediate merge files (default: next to output)\n";
+    std::cout << "  -j, --jobs <n>                Number of merges to run at once (default: 1)\n";
+    std::cout << "  --prefetch <k>                Load and decompress k files ahead of the merge (default: 2)\n\n";
+    std::cout << "OPTIONS (for --daemon):\n";
+    std::cout << "  --output <file>               Merged OSY file, replaced atomically after each batch\n";
+    std::cout << "  -j, --jobs <n>                Number of worker threads (default: hardware threads)\n";
+    std::cout << "  --root <dir>                  Only watch files under this directory\n";
+    std::cout << "  --prune <profile|file>        Leave cursor kinds out of the index: full, navigation, api or a profile file\n";
+    std::cout << "  --scope-include <glob>        Only index headers matching a glob (can be used multiple times)\n";
+    std::cout << "  --scope-exclude <glob>        Do not index headers matching a glob (can be used multiple times)\n";
+    std::cout << "  --system-headers <mode>       full, top-level (namespace scope declarations only) or skip\n";
+    std::cout << "  --decls-only                  Skip function bodies; index declarations only\n";
+    std::cout << "  Commands on stdin: open <file>, close <file>, quit\n\n";
     std::cout << "EXAMPLES:\n";
     std::cout << "  # Parse a C++ file and generate OSY database\n";
     std::cout << "  symbols --compile main.cpp --output main.osy --include-directory /usr/include --define DEBUG=1\n\n";
+    std::cout << "  # Index a whole project on 16 threads\n";
+    std::cout << "  symbols --compile-db build/compile_commands.json --output osy -j 16\n\n";
     std::cout << "  # Merge multiple OSY files\n";
     std::cout << "  symbols --merge file1.osy file2.osy --output merged.osy\n\n";
     std::cout << "  # Dump OSY file contents\n";
@@ -52,6 +109,40 @@ void printUsage()
     std::cout << "  symbols --to-sqlite main.osy main.sqlite\n\n";
 }
 
+// Parses an option that builds up a ScopePolicy. Returns 1 if argv[i] was
+// one, with i moved to its argument, 0 if it was not and -1 on error.
+int ParseScopeOption(int argc, char* argv[], int& i, std::shared_ptr<ScopePolicy>& policy)
+{
+    std::string str(argv[i]);
+    if (str != "--scope-include" && str != "--scope-exclude" && str != "--system-headers")
+        return 0;
+    i++;
+    if (i >= argc)
+    {
+        std::cerr << "Error: " << str << " requires an argument\n";
+        return -1;
+    }
+    if (policy == nullptr)
+        policy.reset(new ScopePolicy());
+    std::string arg = noquotes(argv[i]);
+    if (str == "--scope-include")
+        policy->AddInclude(arg);
+    else if (str == "--scope-exclude")
+        policy->AddExclude(arg);
+    else if (arg == "full")
+        policy->SetSystemHeaders(ScopePolicy::Full);
+    else if (arg == "top-level")
+        policy->SetSystemHeaders(ScopePolicy::TopLevel);
+    else if (arg == "skip")
+        policy->SetSystemHeaders(ScopePolicy::Skip);
+    else
+    {
+        std::cerr << "Error: --system-headers must be full, top-level or skip\n";
+        return -1;
+    }
+    return 1;
+}
+
 extern bool g_fullDbRebuild;
 int main(int argc, char* argv[])
 {
@@ -67,6 +158,9 @@ int main(int argc, char* argv[])
     std::string srcFile;
     std::string outFile;
     std::string pchFile;
+    std::string cacheDir;
+    std::shared_ptr<const PruneProfile> pruneProfile;
+    std::shared_ptr<ScopePolicy> scopePolicy;
     bool dolog = false;
     uint32_t loggingFlags = 0;
 
@@ -104,6 +198,10 @@ int main(int argc, char* argv[])
     else if (!strcmp(argv[1], "--merge"))
     {
         std::vector<std::string> mergeFiles;
+        MergeTree::Options treeOptions;
+        bool mergeTree = false;
+        ExternalMerge::Options externalOptions;
+        bool externalMerge = false;
         for (int i = 2; i < argc; ++i)  // Start from 2 to skip "--merge"
         {
             std::string str(argv[i]);
@@ -118,12 +216,81 @@ int main(int argc, char* argv[])
                     return -1;
                 }
             }
+            else if (str == "--merge-tree")
+            {
+                mergeTree = true;
+                if (i + 1 < argc && !strncmp(argv[i + 1], "fanin=", 6))
+                {
+                    i++;
+                    treeOptions.fanin = std::max(2, atoi(argv[i] + 6));
+                }
+            }
+            else if (str == "--max-memory")
+            {
+                i++;
+                externalOptions.maxMemory = i < argc ? ExternalMerge::ParseSize(argv[i]) : 0;
+                if (externalOptions.maxMemory == 0)
+                {
+                    std::cerr << "Error: --max-memory requires a size such as 8G\n";
+                    return -1;
+                }
+                externalMerge = true;
+            }
+            else if (str == "--temp-dir")
+            {
+                i++;
+                if (i < argc)
+                    externalOptions.tempDir = noquotes(argv[i]);
+                else
+                {
+                    std::cerr << "Error: --temp-dir requires a directory argument\n";
+                    return -1;
+                }
+            }
+            else if (str == "--prefetch")
+            {
+                i++;
+                if (i < argc)
+                    treeOptions.prefetch = std::max(0, atoi(argv[i]));
+                else
+                {
+                    std::cerr << "Error: --prefetch requires a file count\n";
+                    return -1;
+                }
+            }
+            else if (str == "--work-dir")
+            {
+                i++;
+                if (i < argc)
+                    treeOptions.workDir = noquotes(argv[i]);
+                else
+                {
+                    std::cerr << "Error: --work-dir requires a directory argument\n";
+                    return -1;
+                }
+            }
+            else if (str == "-j" || str == "--jobs")
+            {
+                i++;
+                if (i < argc)
+                    treeOptions.jobs = std::max(1, atoi(argv[i]));
+                else
+                {
+                    std::cerr << "Error: " << str << " requires a thread count\n";
+                    return -1;
+                }
+            }
+            else if (str.starts_with("-j"))
+            {
+                treeOptions.jobs = std::max(1, atoi(str.c_str() + 2));
+            }
             else if (str[0] != '-')  // Not a flag, must be a file to merge
             {
                 mergeFiles.push_back(noquotes(argv[i]));
             }
         }
 
+        mergeFiles = MergeTree::ExpandInputs(mergeFiles);
         if (mergeFiles.empty())
         {
             std::cerr << "Error: --merge requires at least one OSY file to merge\n";
@@ -138,28 +305,43 @@ int main(int argc, char* argv[])
             return -1;
         }
 
-        using namespace std::chrono;
-        milliseconds ms0 = duration_cast<milliseconds>(
-            system_clock::now().time_since_epoch());
-        std::cout << "Reading " << mergeFiles[0] << std::endl;
-        DbFile dbFile;
-        dbFile.Load(mergeFiles[0]);
-        for (int idx = 1; idx < mergeFiles.size(); ++idx)
+        if (externalMerge)
         {
-            std::cout << "Merging " << mergeFiles[idx] << std::endl;
-            DbFile dbMerge;
-            dbMerge.Load(mergeFiles[idx]);
-            dbFile.Merge(dbMerge);
-
-//            milliseconds ms1 = duration_cast<milliseconds>(
-//                system_clock::now().time_since_epoch());
+            using namespace std::chrono;
+            milliseconds ms0 = duration_cast<milliseconds>(
+                system_clock::now().time_since_epoch());
+            if (!ExternalMerge::Run(mergeFiles, outFile, externalOptions))
+                return -1;
+            milliseconds ms1 = duration_cast<milliseconds>(
+                system_clock::now().time_since_epoch());
+            float seconds = (ms1 - ms0).count() / 1000.0f;
+            std::cout << seconds << "seconds" << std::endl;
+            return 0;
+        }
 
-//            float seconds = (ms1 - ms0).count() / 1000.0f;
-//            std::cout << seconds << "seconds" << std::endl;
+        if (mergeTree)
+        {
+            using namespace std::chrono;
+            milliseconds ms0 = duration_cast<milliseconds>(
+                system_clock::now().time_since_epoch());
+            if (!MergeTree::Run(mergeFiles, outFile, treeOptions))
+                return -1;
+            milliseconds ms1 = duration_cast<milliseconds>(
+                system_clock::now().time_since_epoch());
+            float seconds = (ms1 - ms0).count() / 1000.0f;
+            std::cout << seconds << "seconds" << std::endl;
+            return 0;
         }
 
+        using namespace std::chrono;
+        milliseconds ms0 = duration_cast<milliseconds>(
+            system_clock::now().time_since_epoch());
+        std::unique_ptr<DbFile> dbFile = MergeTree::Reduce(mergeFiles, treeOptions.jobs, treeOptions.prefetch);
+        if (dbFile == nullptr)
+            return -1;
+
         std::cout << "Writing " << outFile << std::endl;
-        dbFile.Save(outFile);
+        dbFile->Save(outFile);
         milliseconds ms1 = duration_cast<milliseconds>(
             system_clock::now().time_since_epoch());
 
@@ -185,6 +367,330 @@ int main(int argc, char* argv[])
             return -1;
         }
     }
+    else if (!strcmp(argv[1], "--compile-db"))
+    {
+        if (argc < 3)
+        {
+            std::cerr << "Error: --compile-db requires a compile_commands.json argument\n";
+            printUsage();
+            return -1;
+        }
+
+        std::string dbPath = noquotes(argv[2]);
+        BatchIndexer::Options options;
+        options.jobs = std::max(1u, std::thread::hardware_concurrency());
+        options.loggingFlags = loggingFlags;
+        size_t shardIndex = 0;
+        size_t shardCount = 1;
+        bool processIsolation = false;
+        int timeoutSec = 600;
+        for (int i = 3; i < argc; ++i)
+        {
+            std::string str(argv[i]);
+            if (str == "--output")
+            {
+                i++;
+                if (i < argc)
+                    options.outDir = noquotes(argv[i]);
+                else
+                {
+                    std::cerr << "Error: --output requires a directory argument\n";
+                    return -1;
+                }
+            }
+            else if (str == "-j" || str == "--jobs")
+            {
+                i++;
+                if (i < argc)
+                    options.jobs = std::max(1, atoi(argv[i]));
+                else
+                {
+                    std::cerr << "Error: " << str << " requires a thread count\n";
+                    return -1;
+                }
+            }
+            else if (str.starts_with("-j"))
+            {
+                options.jobs = std::max(1, atoi(str.c_str() + 2));
+            }
+            else if (str == "--workers")
+            {
+                i++;
+                if (i < argc)
+                    options.jobs = std::max(1, atoi(argv[i]));
+                else
+                {
+                    std::cerr << "Error: --workers requires a worker count\n";
+                    return -1;
+                }
+            }
+            else if (str == "--isolation")
+            {
+                i++;
+                std::string mode = i < argc ? argv[i] : "";
+                if (mode != "process" && mode != "thread")
+                {
+                    std::cerr << "Error: --isolation must be process or thread\n";
+                    return -1;
+                }
+                processIsolation = mode == "process";
+            }
+            else if (str == "--timeout")
+            {
+                i++;
+                if (i < argc)
+                    timeoutSec = std::max(1, atoi(argv[i]));
+                else
+                {
+                    std::cerr << "Error: --timeout requires a number of seconds\n";
+                    return -1;
+                }
+            }
+            else if (str == "--merged-output")
+            {
+                i++;
+                if (i < argc)
+                    options.mergedOutput = noquotes(argv[i]);
+                else
+                {
+                    std::cerr << "Error: --merged-output requires a file argument\n";
+                    return -1;
+                }
+            }
+            else if (str == "--shard")
+            {
+                i++;
+                if (i >= argc || sscanf(argv[i], "%zu/%zu", &shardIndex, &shardCount) != 2 ||
+                    shardCount == 0 || shardIndex >= shardCount)
+                {
+                    std::cerr << "Error: --shard requires an argument of the form i/N with 0 <= i < N\n";
+                    return -1;
+                }
+            }
+            else if (str == "--decls-only")
+            {
+                options.loggingFlags |= IndexSession::DeclsOnly;
+            }
+            else if (int scopeArg = ParseScopeOption(argc, argv, i, scopePolicy))
+            {
+                if (scopeArg < 0)
+                    return -1;
+            }
+            else if (str == "--prune")
+            {
+                i++;
+                options.pruneProfile = i < argc ? PruneProfile::Create(noquotes(argv[i])) : nullptr;
+                if (options.pruneProfile == nullptr)
+                {
+                    std::cerr << "Error: --prune requires a profile name or file\n";
+                    return -1;
+                }
+            }
+            else if (str == "--history")
+            {
+                i++;
+                if (i < argc)
+                    options.historyFile = noquotes(argv[i]);
+                else
+                {
+                    std::cerr << "Error: --history requires a file argument\n";
+                    return -1;
+                }
+            }
+            else if (str == "--max-memory")
+            {
+                i++;
+                options.maxMemory = i < argc ? ExternalMerge::ParseSize(argv[i]) : 0;
+                if (options.maxMemory == 0)
+                {
+                    std::cerr << "Error: --max-memory requires a size such as 8G or 512M\n";
+                    return -1;
+                }
+            }
+            else if (str == "--no-shared-headers")
+            {
+                options.shareHeaders = false;
+            }
+            else if (str == "--no-auto-pch")
+            {
+                options.autoPch = false;
+            }
+            else if (str == "--cache-dir")
+            {
+                i++;
+                if (i < argc)
+                    options.cacheDir = noquotes(argv[i]);
+                else
+                {
+                    std::cerr << "Error: --cache-dir requires a directory argument\n";
+                    return -1;
+                }
+            }
+            else
+            {
+                std::cerr << "Error: Unknown option '" << str << "' for --compile-db\n";
+                printUsage();
+                return -1;
+            }
+        }
+
+        options.scopePolicy = scopePolicy;
+        if (options.outDir.empty() && options.mergedOutput.empty())
+        {
+            std::cerr << "Error: --compile-db requires --output to specify the output directory\n";
+            printUsage();
+            return -1;
+        }
+        if (!options.mergedOutput.empty() && !options.cacheDir.empty())
+        {
+            std::cerr << "Error: --cache-dir cannot be combined with --merged-output\n";
+            return -1;
+        }
+        if (processIsolation && (options.outDir.empty() || !options.mergedOutput.empty() || !options.cacheDir.empty()))
+        {
+            std::cerr << "Error: --isolation process writes one OSY per TU to --output and supports neither --merged-output nor --cache-dir\n";
+            return -1;
+        }
+
+        std::vector<CompileCommand> commands;
+        try
+        {
+            commands = CompileDb::Load(dbPath);
+        }
+        catch (std::exception& ex)
+        {
+            std::cerr << "Error: " << ex.what() << std::endl;
+            return -1;
+        }
+
+        if (shardCount > 1)
+        {
+            size_t total = commands.size();
+            commands = BatchIndexer::SelectShard(commands, shardIndex, shardCount);
+            std::cout << "Shard " << shardIndex << "/" << shardCount << ": " << commands.size() <<
+                " of " << total << " translation units" << std::endl;
+        }
+
+        using namespace std::chrono;
+        milliseconds ms0 = duration_cast<milliseconds>(
+            system_clock::now().time_since_epoch());
+        std::cout << "Indexing " << commands.size() << " translation units on " << options.jobs << " threads" << std::endl;
+        size_t failed;
+        if (processIsolation)
+        {
+            ProcessIndexer::Options processOptions;
+            processOptions.outDir = options.outDir;
+            processOptions.rootDir = options.rootDir;
+            processOptions.workers = options.jobs;
+            processOptions.loggingFlags = options.loggingFlags;
+            processOptions.timeoutSec = timeoutSec;
+            processOptions.pruneProfile = options.pruneProfile;
+            processOptions.scopePolicy = options.scopePolicy;
+            ProcessIndexer indexer(processOptions);
+            failed = indexer.Run(commands);
+        }
+        else
+        {
+            BatchIndexer indexer(options);
+            failed = indexer.Run(commands);
+        }
+        milliseconds ms1 = duration_cast<milliseconds>(
+            system_clock::now().time_since_epoch());
+        float seconds = (ms1 - ms0).count() / 1000.0f;
+        std::cout << seconds << "seconds" << std::endl;
+        if (failed > 0)
+        {
+            std::cerr << "Error: " << failed << " translation units failed to index" << std::endl;
+            return -1;
+        }
+    }
+    else if (!strcmp(argv[1], "--daemon"))
+    {
+        if (argc < 3)
+        {
+            std::cerr << "Error: --daemon requires a compile_commands.json argument\n";
+            printUsage();
+            return -1;
+        }
+
+        std::string dbPath = noquotes(argv[2]);
+        IndexDaemon::Options options;
+        options.jobs = std::max(1u, std::thread::hardware_concurrency());
+        options.loggingFlags = loggingFlags;
+        for (int i = 3; i < argc; ++i)
+        {
+            std::string str(argv[i]);
+            if (str == "--output" || str == "--root")
+            {
+                i++;
+                if (i >= argc)
+                {
+                    std::cerr << "Error: " << str << " requires a path argument\n";
+                    return -1;
+                }
+                if (str == "--output")
+                    options.output = noquotes(argv[i]);
+                else
+                    options.rootDir = noquotes(argv[i]);
+            }
+            else if (str == "--decls-only")
+            {
+                options.loggingFlags |= IndexSession::DeclsOnly;
+            }
+            else if (int scopeArg = ParseScopeOption(argc, argv, i, scopePolicy))
+            {
+                if (scopeArg < 0)
+                    return -1;
+            }
+            else if (str == "--prune")
+            {
+                i++;
+                options.pruneProfile = i < argc ? PruneProfile::Create(noquotes(argv[i])) : nullptr;
+                if (options.pruneProfile == nullptr)
+                {
+                    std::cerr << "Error: --prune requires a profile name or file\n";
+                    return -1;
+                }
+            }
+            else if (str == "-j" || str == "--jobs")
+            {
+                i++;
+                if (i < argc)
+                    options.jobs = std::max(1, atoi(argv[i]));
+                else
+                {
+                    std::cerr << "Error: " << str << " requires a thread count\n";
+                    return -1;
+                }
+            }
+            else if (str.starts_with("-j"))
+            {
+                options.jobs = std::max(1, atoi(str.c_str() + 2));
+            }
+        }
+
+        options.scopePolicy = scopePolicy;
+        if (options.output.empty())
+        {
+            std::cerr << "Error: --daemon requires --output to specify the OSY file\n";
+            printUsage();
+            return -1;
+        }
+
+        std::vector<CompileCommand> commands;
+        try
+        {
+            commands = CompileDb::Load(dbPath);
+        }
+        catch (std::exception& ex)
+        {
+            std::cerr << "Error: " << ex.what() << std::endl;
+            return -1;
+        }
+
+        IndexDaemon daemon(options);
+        return daemon.Run(commands);
+    }
     else if (!strcmp(argv[1], "--compile"))
     {
         if (argc < 3)
@@ -233,6 +739,36 @@ int main(int argc, char* argv[])
                     return -1;
                 }
             }
+            else if (str == "--cache-dir")
+            {
+                i++;
+                if (i < argc)
+                    cacheDir = noquotes(argv[i]);
+                else
+                {
+                    std::cerr << "Error: --cache-dir requires a directory argument\n";
+                    return -1;
+                }
+            }
+            else if (str == "--decls-only")
+            {
+                loggingFlags |= IndexSession::DeclsOnly;
+            }
+            else if (int scopeArg = ParseScopeOption(argc, argv, i, scopePolicy))
+            {
+                if (scopeArg < 0)
+                    return -1;
+            }
+            else if (str == "--prune")
+            {
+                i++;
+                pruneProfile = i < argc ? PruneProfile::Create(noquotes(argv[i])) : nullptr;
+                if (pruneProfile == nullptr)
+                {
+                    std::cerr << "Error: --prune requires a profile name or file\n";
+                    return -1;
+                }
+            }
             else if (str[0] == '-')
             {
                 misc_args.insert(str);
@@ -250,7 +786,16 @@ int main(int argc, char* argv[])
         srcFile = p.string();
         bool doPch = misc_args.find("--emit-pch") != misc_args.end();
         std::vector<std::string> misc(misc_args.begin(), misc_args.end());
-        Compiler::Inst()->Compile(srcFile, outFile, includeFiles, defines, misc, doPch, pchFile, "", loggingFlags);
+        std::unique_ptr<CompileCache> cache;
+        IndexSession session;
+        if (!cacheDir.empty())
+        {
+            cache.reset(new CompileCache(cacheDir));
+            session.SetCompileCache(cache.get());
+        }
+        session.SetPruneProfile(pruneProfile);
+        session.SetScopePolicy(scopePolicy);
+        session.Compile(srcFile, outFile, includeFiles, defines, misc, doPch, pchFile, "", loggingFlags);
     }
     else
     {